@@ -0,0 +1,225 @@
+#include <rpc/client.h>
+#include <rpc/rpc_error.h>
+#include <nlohmann/json.hpp>
+#include <paxos/paxos.hpp>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Leader egress per committed command.
+ * Usage: bandwidth_bench <path to paxos> [blob KiB] [count]
+ *
+ * Starts every node of ./config.json, submits count blobs of the given
+ * size through the leader and reports how many payload bytes the leader
+ * sent to its peers per commit, from the sent_bytes of its summary. Run it
+ * once with erasure_k at 1 and once above it to compare; with k, the
+ * leader should send about 1/k of what it sends without coding.
+ *
+ * The blobs are read back through a follower at the end, which has to
+ * rebuild the coded ones from the fragments of the others.
+ */
+
+namespace
+{
+    using clk = std::chrono::steady_clock;
+
+    struct node
+    {
+        std::string host;
+        int port;
+        pid_t pid = -1;
+    };
+
+    pid_t spawn(const std::string& binary, int id)
+    {
+        auto pid = fork();
+        if (pid == 0)
+        {
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            auto id_str = std::to_string(id);
+            execl(binary.c_str(), binary.c_str(), id_str.c_str(), nullptr);
+            _exit(127);
+        }
+        return pid;
+    }
+
+    int ask_leader(const node& n)
+    {
+        try
+        {
+            rpc::client c(n.host, n.port);
+            c.set_timeout(50);
+            return c.call("get_leader").as<uint8_t>();
+        }
+        catch (std::exception&)
+        {
+            return 0xFF;
+        }
+    }
+
+    int find_leader(const std::vector<node>& nodes, std::chrono::milliseconds give_up)
+    {
+        auto began = clk::now();
+        while (clk::now() - began < give_up)
+        {
+            for (int i = 0; i < int(nodes.size()); ++i)
+            {
+                if (ask_leader(nodes[i]) == i)
+                {
+                    return i;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return -1;
+    }
+
+    paxos::summary summary_of(const node& n)
+    {
+        rpc::client c(n.host, n.port * 2);
+        c.set_timeout(2000);
+        return c.call("summary").as<paxos::summary>();
+    }
+
+    // submits and waits out admission control, false if the leader never took it
+    bool submit(rpc::client& c, int client_id, const paxos::blob& payload)
+    {
+        for (int attempt = 0; attempt < 50; ++attempt)
+        {
+            try
+            {
+                c.call("submit", client_id, payload);
+                return true;
+            }
+            catch (rpc::rpc_error& err)
+            {
+                auto [reason, retry_ms] = err.get_error().as<std::tuple<std::string, int>>();
+                std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
+            }
+            catch (rpc::timeout&)
+            {
+            }
+        }
+        return false;
+    }
+
+    // blobs of the given size a node can hand out in full
+    int count_readable(const node& n, size_t size)
+    {
+        rpc::client c(n.host, n.port * 2);
+        c.set_timeout(10000);
+        int res = 0;
+        for (int cursor = 0; cursor != -1;)
+        {
+            auto page = c.call("log_range", cursor, 100).as<paxos::log_page>();
+            for (auto& e : page.entries)
+            {
+                auto bl = e.second.bl();
+                res += bl && bl->size() == size;
+            }
+            cursor = page.next;
+        }
+        return res;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <path to paxos> [blob KiB] [count]\n";
+        return 1;
+    }
+
+    const std::string binary = argv[1];
+    const size_t size = (argc > 2 ? std::stoul(argv[2]) : 64) * 1024;
+    const int count = argc > 3 ? std::stoi(argv[3]) : 50;
+
+    std::ifstream in("config.json");
+    nlohmann::json config;
+    in >> config;
+    const int k = config.value("erasure_k", 1);
+
+    std::vector<node> nodes;
+    for (auto& p : config["nodes"])
+    {
+        node n;
+        n.host = p["ip"].get<std::string>();
+        n.port = p["port"].get<int>();
+        nodes.push_back(n);
+    }
+
+    for (int i = 0; i < int(nodes.size()); ++i)
+    {
+        nodes[i].pid = spawn(binary, i);
+    }
+
+    auto shutdown = [&nodes] {
+        for (auto& n : nodes)
+        {
+            kill(n.pid, SIGKILL);
+            waitpid(n.pid, nullptr, 0);
+        }
+    };
+
+    auto leader = find_leader(nodes, std::chrono::seconds(10));
+    if (leader == -1)
+    {
+        std::cerr << "no leader came up\n";
+        shutdown();
+        return 1;
+    }
+
+    std::mt19937 rng(std::random_device{}());
+    std::vector<char> bytes(size);
+    for (auto& b : bytes)
+    {
+        b = char(rng());
+    }
+    paxos::blob payload(std::move(bytes));
+
+    auto before = summary_of(nodes[leader]).sent_bytes;
+    rpc::client c(nodes[leader].host, nodes[leader].port * 2);
+    c.set_timeout(10000);
+
+    const int client_id = std::uniform_int_distribution<int>(1000, 1 << 30)(rng);
+    int committed = 0;
+    auto began = clk::now();
+    for (int i = 0; i < count; ++i)
+    {
+        committed += submit(c, client_id, payload);
+    }
+    std::chrono::duration<double> took = clk::now() - began;
+    auto sent = summary_of(nodes[leader]).sent_bytes - before;
+
+    // give the last decisions time to land before reading them back elsewhere
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    auto follower = (leader + 1) % int(nodes.size());
+    auto readable = count_readable(nodes[follower], size);
+
+    shutdown();
+
+    if (committed == 0)
+    {
+        std::cerr << "nothing was committed\n";
+        return 1;
+    }
+
+    auto per_commit = double(sent) / committed;
+    std::printf("k=%d, %zu KiB blobs: %d committed in %.2f s\n", k, size / 1024, committed, took.count());
+    std::printf("leader sent %.1f KiB per commit, %.2f blob sizes\n", per_commit / 1024, per_commit / size);
+    std::printf("node %d reads %d of them back whole\n", follower, readable);
+}
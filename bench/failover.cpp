@@ -0,0 +1,252 @@
+#include <rpc/client.h>
+#include <rpc/rpc_error.h>
+#include <nlohmann/json.hpp>
+#include <paxos/paxos.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Time to a new leader after the leader is killed.
+ * Usage: failover_bench <path to paxos> [rounds] [nosession]
+ *
+ * Starts every node of ./config.json, waits for a leader, SIGKILLs it and
+ * measures how long it takes until a surviving node reports itself as the
+ * leader. The killed node is restarted before the next round.
+ *
+ * Meanwhile a client keeps buying through the client endpoints and retries
+ * every failure like client.cpp does. At the end the purchases that made it
+ * into the log are counted, more than one per successful request means
+ * retries ran consensus again. Pass nosession to send them without a
+ * session for comparison.
+ */
+
+namespace
+{
+    using clk = std::chrono::steady_clock;
+
+    struct node
+    {
+        std::string host;
+        int port;
+        pid_t pid = -1;
+    };
+
+    pid_t spawn(const std::string& binary, int id)
+    {
+        auto pid = fork();
+        if (pid == 0)
+        {
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            auto id_str = std::to_string(id);
+            execl(binary.c_str(), binary.c_str(), id_str.c_str(), nullptr);
+            _exit(127);
+        }
+        return pid;
+    }
+
+    // what the node thinks the leader is, 0xFF if it doesn't know or doesn't answer
+    int ask_leader(const node& n)
+    {
+        try
+        {
+            rpc::client c(n.host, n.port);
+            c.set_timeout(50);
+            return c.call("get_leader").as<uint8_t>();
+        }
+        catch (std::exception&)
+        {
+            return 0xFF;
+        }
+    }
+
+    /*
+     * Buys a ticket at a time until told to stop, following redirects and
+     * retrying failures with the same request id. Returns the number of
+     * purchases acknowledged.
+     */
+    int buy_loop(const std::vector<node>& nodes, int client_id, bool sessions, const std::atomic<bool>& stop)
+    {
+        int done = 0;
+        int target = 0;
+        for (int request = 1; !stop; ++request)
+        {
+            while (!stop)
+            {
+                try
+                {
+                    rpc::client c(nodes[target].host, nodes[target].port * 2);
+                    c.set_timeout(1000);
+                    auto id = sessions ? c.call("buy", 0, client_id, client_id, request).as<uint8_t>()
+                                       : c.call("buy", 0, client_id, 0, 0).as<uint8_t>();
+                    if (id == target)
+                    {
+                        ++done;
+                        break;
+                    }
+                    target = id == 0xFF ? (target + 1) % int(nodes.size()) : id;
+                }
+                catch (std::exception&)
+                {
+                    target = (target + 1) % int(nodes.size());
+                }
+            }
+        }
+        return done;
+    }
+
+    // purchases of the client that were committed, read from the given node
+    int count_committed(const node& n, int client_id)
+    {
+        rpc::client c(n.host, n.port * 2);
+        c.set_timeout(2000);
+        int res = 0;
+        for (int cursor = 0; cursor != -1;)
+        {
+            auto page = c.call("log_range", cursor, 1000).as<paxos::log_page>();
+            for (auto& e : page.entries)
+            {
+                auto ts = e.second.ts();
+                res += ts && ts->client_id == client_id;
+            }
+            cursor = page.next;
+        }
+        return res;
+    }
+
+    // a node that answers for itself is the leader
+    int find_leader(const std::vector<node>& nodes, int except, std::chrono::milliseconds give_up)
+    {
+        auto began = clk::now();
+        while (clk::now() - began < give_up)
+        {
+            for (int i = 0; i < int(nodes.size()); ++i)
+            {
+                if (i == except) continue;
+                if (ask_leader(nodes[i]) == i)
+                {
+                    return i;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        return -1;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <path to paxos> [rounds] [nosession]\n";
+        return 1;
+    }
+
+    const std::string binary = argv[1];
+    const int rounds = argc > 2 ? std::stoi(argv[2]) : 10;
+    const bool sessions = !(argc > 3 && std::string(argv[3]) == "nosession");
+
+    std::ifstream in("config.json");
+    nlohmann::json config;
+    in >> config;
+
+    std::vector<node> nodes;
+    for (auto& p : config["nodes"])
+    {
+        node n;
+        n.host = p["ip"].get<std::string>();
+        n.port = p["port"].get<int>();
+        nodes.push_back(n);
+    }
+
+    for (int i = 0; i < int(nodes.size()); ++i)
+    {
+        nodes[i].pid = spawn(binary, i);
+    }
+
+    // a fresh client id tells this run's purchases apart from what's already in the logs
+    std::random_device rd;
+    const int client_id = std::uniform_int_distribution<int>(1000, 1 << 30)(rd);
+    std::atomic<bool> stop_buying{false};
+    int acknowledged = 0;
+    std::thread buyer([&] {
+        acknowledged = buy_loop(nodes, client_id, sessions, stop_buying);
+    });
+
+    std::vector<double> samples;
+    for (int r = 0; r < rounds; ++r)
+    {
+        auto leader = find_leader(nodes, -1, std::chrono::seconds(10));
+        if (leader == -1)
+        {
+            std::cerr << "no leader came up\n";
+            break;
+        }
+
+        // let followers settle on the leader's heartbeat period
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        kill(nodes[leader].pid, SIGKILL);
+        waitpid(nodes[leader].pid, nullptr, 0);
+        auto killed_at = clk::now();
+
+        auto next = find_leader(nodes, leader, std::chrono::seconds(10));
+        std::chrono::duration<double, std::milli> took = clk::now() - killed_at;
+        if (next == -1)
+        {
+            std::cerr << "round " << r << ": nobody took over\n";
+            break;
+        }
+
+        std::printf("round %2d: %d -> %d in %.1f ms\n", r, leader, next, took.count());
+        samples.push_back(took.count());
+
+        nodes[leader].pid = spawn(binary, leader);
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+
+    stop_buying = true;
+    buyer.join();
+
+    int committed = -1;
+    if (auto leader = find_leader(nodes, -1, std::chrono::seconds(10)); leader != -1)
+    {
+        // give the last decisions time to reach the leader's state
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        committed = count_committed(nodes[leader], client_id);
+    }
+
+    for (auto& n : nodes)
+    {
+        kill(n.pid, SIGKILL);
+        waitpid(n.pid, nullptr, 0);
+    }
+
+    if (samples.empty())
+    {
+        return 1;
+    }
+
+    if (committed >= 0 && acknowledged > 0)
+    {
+        std::printf("%d purchases acknowledged, %d in the log, %.2f consensus rounds per success%s\n",
+                    acknowledged, committed, double(committed) / acknowledged, sessions ? "" : " (no session)");
+    }
+
+    std::sort(samples.begin(), samples.end());
+    std::printf("median %.1f ms, p90 %.1f ms, max %.1f ms\n",
+                samples[samples.size() / 2], samples[samples.size() * 9 / 10], samples.back());
+}
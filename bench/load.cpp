@@ -0,0 +1,130 @@
+#include <rpc/client.h>
+#include <rpc/rpc_error.h>
+#include <nlohmann/json.hpp>
+#include <paxos/admission.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Open loop load test for the client endpoint.
+ * Usage: load_bench <node id> <requests per second> <seconds> [connections]
+ *
+ * Requests are scheduled at a fixed rate no matter how the server keeps up
+ * and latency is measured from the scheduled time, so queueing shows up in
+ * the numbers. Run it once near capacity and once at twice that to see how
+ * admission control holds goodput and tail latency. Buys are for zero
+ * tickets so the 100 ticket cap never ends the run early.
+ */
+
+namespace
+{
+    using clk = std::chrono::steady_clock;
+
+    struct results
+    {
+        std::mutex prot;
+        std::vector<double> latencies_ms;
+        int64_t rejected = 0;
+        int64_t timeouts = 0;
+        int64_t errors = 0;
+    };
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        std::cerr << "usage: " << argv[0] << " <node id> <requests per second> <seconds> [connections]\n";
+        return 1;
+    }
+
+    const int node_id = std::stoi(argv[1]);
+    const double rate = std::stod(argv[2]);
+    const double seconds = std::stod(argv[3]);
+    const int connections = argc > 4 ? std::stoi(argv[4]) : 64;
+
+    std::ifstream in("config.json");
+    nlohmann::json config;
+    in >> config;
+    const auto host = config["nodes"][node_id]["ip"].get<std::string>();
+    const auto port = config["nodes"][node_id]["port"].get<int>() * 2;
+
+    const auto total = int64_t(rate * seconds);
+    const auto interval = std::chrono::duration<double>(1.0 / rate);
+    const auto start = clk::now() + std::chrono::milliseconds(100);
+
+    results res;
+    std::vector<std::thread> workers;
+    for (int w = 0; w < connections; ++w)
+    {
+        workers.emplace_back([&, w] {
+            rpc::client c(host, port);
+            c.set_timeout(5000);
+
+            std::vector<double> mine;
+            for (int64_t i = w; i < total; i += connections)
+            {
+                auto scheduled = start + std::chrono::duration_cast<clk::duration>(interval * double(i));
+                std::this_thread::sleep_until(scheduled);
+                try
+                {
+                    c.call("buy", 0, 1000 + w, 0, 0);
+                    mine.push_back(std::chrono::duration<double, std::milli>(clk::now() - scheduled).count());
+                }
+                catch (rpc::rpc_error&)
+                {
+                    std::lock_guard<std::mutex> lk{res.prot};
+                    ++res.rejected;
+                }
+                catch (rpc::timeout&)
+                {
+                    std::lock_guard<std::mutex> lk{res.prot};
+                    ++res.timeouts;
+                }
+                catch (std::exception&)
+                {
+                    std::lock_guard<std::mutex> lk{res.prot};
+                    ++res.errors;
+                }
+            }
+
+            std::lock_guard<std::mutex> lk{res.prot};
+            res.latencies_ms.insert(res.latencies_ms.end(), mine.begin(), mine.end());
+        });
+    }
+
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+    std::chrono::duration<double> elapsed = clk::now() - start;
+
+    auto& lat = res.latencies_ms;
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&lat](double p) { return lat.empty() ? 0.0 : lat[std::min(lat.size() - 1, size_t(p * lat.size()))]; };
+
+    std::printf("offered %.1f req/s for %.1f s over %d connections\n", rate, seconds, connections);
+    std::printf("goodput %.1f req/s, rejected %lld, timed out %lld, errors %lld\n",
+                lat.size() / elapsed.count(), (long long)res.rejected, (long long)res.timeouts, (long long)res.errors);
+    std::printf("latency p50 %.1f ms, p99 %.1f ms, max %.1f ms\n", pct(0.5), pct(0.99), lat.empty() ? 0.0 : lat.back());
+
+    try
+    {
+        rpc::client c(host, port);
+        auto st = c.call("stats").as<paxos::admission::stats>();
+        std::printf("server: max depth %d, admitted %lld, rejected %lld overload / %lld rate / %lld timed out, service %.1f ms\n",
+                    st.max_depth, (long long)st.admitted, (long long)st.rejected_overload,
+                    (long long)st.rejected_rate, (long long)st.timed_out, st.service_ms);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "couldn't fetch stats: " << e.what() << '\n';
+    }
+}
@@ -0,0 +1,402 @@
+#include <benchmark/benchmark.h>
+#include <paxos/local_end.hpp>
+#include <paxos/remote_end.hpp>
+#include <paxos/shm.hpp>
+#include <rpc/server.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+/*
+ * Microbenchmarks of the serialization, log, quorum and transport code
+ * on the hot path. Runs headless and prints JSON unless told otherwise,
+ * so the numbers of two builds can be diffed with Google Benchmark's
+ * compare.py.
+ *
+ * Usage: paxos_bench [--benchmark_filter=...] [--benchmark_out=file]
+ *
+ * Everything runs in a fresh temporary directory, the log files the
+ * local_end instances create are left there.
+ */
+
+namespace msgpack = RPCLIB_MSGPACK;
+
+namespace paxos
+{
+    struct local_end_access
+    {
+        using state = local_end::state;
+
+        static void put(local_end& le, int index, const log_entry& e)
+        {
+            std::lock_guard<std::shared_mutex> lk{le.m_log_prot};
+            le.entry(index) = e;
+        }
+
+        static void dump(local_end& le, int index, const log_entry& e)
+        {
+            uint64_t seq;
+            {
+                std::lock_guard<std::shared_mutex> lk{le.m_log_prot};
+                le.entry(index) = e;
+                seq = le.dump_log(index);
+            }
+            le.m_store.wait(seq);
+        }
+
+        static bool accept(local_end& le, ballot bal, value val)
+        {
+            return le.accept(bal, std::move(val));
+        }
+
+        static int applied(local_end& le)
+        {
+            std::lock_guard<std::shared_mutex> lk{le.m_log_prot};
+            return le.m_state.last_log;
+        }
+    };
+}
+
+namespace
+{
+    using paxos::local_end_access;
+
+    // every local_end gets its own id so the log files and loggers don't clash
+    int next_id = 100;
+
+    paxos::log_entry make_entry(int i, bool committed = true)
+    {
+        paxos::log_entry e;
+        e.m_cur_bal = paxos::ballot{ 1, i % 5, i }.pack();
+        e.m_accept_bal = e.m_cur_bal;
+        e.m_val = paxos::value{ 0, { i % 5, 1 } };
+        e.m_commited = committed;
+        return e;
+    }
+
+    paxos::promise make_promise(int i)
+    {
+        return { paxos::ballot{ 2, 1, i }, paxos::ballot{ 1, 0, i }, paxos::value{ 0, { 3, 1 } }, true };
+    }
+
+    std::map<int, paxos::log_entry> make_map(int n)
+    {
+        std::map<int, paxos::log_entry> res;
+        for (int i = 1; i <= n; ++i)
+        {
+            res.emplace(i, make_entry(i));
+        }
+        return res;
+    }
+
+    // a local_end on an ephemeral port that leaves no logger behind
+    struct instance
+    {
+        int id;
+        std::unique_ptr<paxos::local_end> le;
+
+        explicit instance(int node_id, paxos::log_store::durability mode = paxos::log_store::durability::none)
+                : id(node_id), le(std::make_unique<paxos::local_end>(0, node_id))
+        {
+            le->set_durability(mode, std::chrono::microseconds(200));
+        }
+
+        ~instance()
+        {
+            le.reset();
+            spdlog::drop("le_log" + std::to_string(id));
+        }
+    };
+
+    template <class T>
+    void encode(benchmark::State& st, const T& val)
+    {
+        msgpack::sbuffer sbuf;
+        for (auto _ : st)
+        {
+            sbuf.clear();
+            msgpack::pack(sbuf, val);
+            benchmark::DoNotOptimize(sbuf.data());
+        }
+        st.SetBytesProcessed(int64_t(st.iterations()) * sbuf.size());
+    }
+
+    template <class T>
+    void decode(benchmark::State& st, const T& val)
+    {
+        msgpack::sbuffer sbuf;
+        msgpack::pack(sbuf, val);
+        for (auto _ : st)
+        {
+            auto oh = msgpack::unpack(sbuf.data(), sbuf.size());
+            auto res = oh.get().as<T>();
+            benchmark::DoNotOptimize(res);
+        }
+        st.SetBytesProcessed(int64_t(st.iterations()) * sbuf.size());
+    }
+
+    void BM_encode_ballot(benchmark::State& st) { encode(st, paxos::ballot{ 3, 1, 42 }); }
+    void BM_decode_ballot(benchmark::State& st) { decode(st, paxos::ballot{ 3, 1, 42 }); }
+    void BM_encode_promise(benchmark::State& st) { encode(st, make_promise(42)); }
+    void BM_decode_promise(benchmark::State& st) { decode(st, make_promise(42)); }
+    void BM_encode_log_entry(benchmark::State& st) { encode(st, make_entry(42)); }
+    void BM_decode_log_entry(benchmark::State& st) { decode(st, make_entry(42)); }
+    void BM_encode_log_map(benchmark::State& st) { encode(st, make_map(int(st.range(0)))); }
+    void BM_decode_log_map(benchmark::State& st) { decode(st, make_map(int(st.range(0)))); }
+
+    BENCHMARK(BM_encode_ballot);
+    BENCHMARK(BM_decode_ballot);
+    BENCHMARK(BM_encode_promise);
+    BENCHMARK(BM_decode_promise);
+    BENCHMARK(BM_encode_log_entry);
+    BENCHMARK(BM_decode_log_entry);
+    BENCHMARK(BM_encode_log_map)->RangeMultiplier(16)->Range(16, 1 << 16);
+    BENCHMARK(BM_decode_log_map)->RangeMultiplier(16)->Range(16, 1 << 16);
+
+    paxos::value make_blob(int64_t size)
+    {
+        return paxos::value{ paxos::blob(std::vector<char>(size, 'x')) };
+    }
+
+    void BM_encode_blob(benchmark::State& st) { encode(st, make_blob(st.range(0))); }
+    void BM_decode_blob(benchmark::State& st) { decode(st, make_blob(st.range(0))); }
+
+    // what every hop through the pipeline pays to carry a command along
+    void BM_copy_blob(benchmark::State& st)
+    {
+        auto v = make_blob(st.range(0));
+        for (auto _ : st)
+        {
+            paxos::value copy = v;
+            benchmark::DoNotOptimize(copy);
+        }
+    }
+
+    BENCHMARK(BM_encode_blob)->RangeMultiplier(16)->Range(64, 1 << 16);
+    BENCHMARK(BM_decode_blob)->RangeMultiplier(16)->Range(64, 1 << 16);
+    BENCHMARK(BM_copy_blob)->RangeMultiplier(16)->Range(64, 1 << 16);
+
+    // one slot persisted per iteration, range(0) is the durability mode
+    void BM_dump_log(benchmark::State& st)
+    {
+        instance node(next_id++, paxos::log_store::durability(st.range(0)));
+        auto e = make_entry(1);
+        int i = 1;
+        for (auto _ : st)
+        {
+            local_end_access::dump(*node.le, i++, e);
+        }
+        st.SetItemsProcessed(st.iterations());
+    }
+    BENCHMARK(BM_dump_log)->Arg(int(paxos::log_store::durability::none))
+                          ->Arg(int(paxos::log_store::durability::group))
+                          ->UseRealTime();
+
+    /*
+     * Acceptors taking accepts from the benchmark's threads at once, each
+     * thread on slots of its own as under a pipelined leader. range(0) is
+     * the durability mode, accepts per second should grow with the threads.
+     */
+    std::unique_ptr<instance> shared_node;
+
+    void BM_accept_parallel(benchmark::State& st)
+    {
+        if (st.thread_index() == 0)
+        {
+            shared_node = std::make_unique<instance>(next_id++, paxos::log_store::durability(st.range(0)));
+        }
+
+        auto val = paxos::value{ 0, { 1, 0 } };
+        int slot = 1 + st.thread_index();
+        for (auto _ : st)
+        {
+            if (!local_end_access::accept(*shared_node->le, paxos::ballot{ 1, 0, slot }, val))
+            {
+                st.SkipWithError("accept was rejected");
+                break;
+            }
+            slot += st.threads();
+        }
+        st.SetItemsProcessed(st.iterations());
+
+        if (st.thread_index() == 0)
+        {
+            shared_node.reset();
+        }
+    }
+    BENCHMARK(BM_accept_parallel)->Arg(int(paxos::log_store::durability::none))
+                                 ->Arg(int(paxos::log_store::durability::group))
+                                 ->ThreadRange(1, 16)
+                                 ->UseRealTime();
+
+    // recovery of a committed log of range(0) slots, the whole local_end start up
+    void BM_load_log(benchmark::State& st)
+    {
+        auto id = next_id++;
+        {
+            std::remove(("log" + std::to_string(id) + ".mpk").c_str());
+            paxos::log_store store("log" + std::to_string(id) + ".mpk");
+            store.open();
+            uint64_t seq = 0;
+            for (int i = 1; i <= st.range(0); ++i)
+            {
+                seq = store.append(i, make_entry(i));
+            }
+            store.wait(seq);
+        }
+
+        for (auto _ : st)
+        {
+            auto node = std::make_unique<instance>(id);
+            st.PauseTiming();
+            if (local_end_access::applied(*node->le) != st.range(0))
+            {
+                st.SkipWithError("log wasn't recovered");
+            }
+            node.reset();
+            st.ResumeTiming();
+        }
+        st.SetItemsProcessed(st.iterations() * st.range(0));
+    }
+    BENCHMARK(BM_load_log)->RangeMultiplier(10)->Range(1000, 100000)->Unit(benchmark::kMillisecond);
+
+    // range(0) slots in memory, the newest range(1) of them undecided
+    void tail_bench(benchmark::State& st, int (paxos::local_end::*fn)() const)
+    {
+        instance node(next_id++);
+        auto n = int(st.range(0));
+        for (int i = 1; i <= n; ++i)
+        {
+            local_end_access::put(*node.le, i, make_entry(i, i <= n - st.range(1)));
+        }
+        for (auto _ : st)
+        {
+            benchmark::DoNotOptimize(((*node.le).*fn)());
+        }
+    }
+
+    void BM_get_first_hole(benchmark::State& st) { tail_bench(st, &paxos::local_end::get_first_hole); }
+    void BM_get_last_log(benchmark::State& st) { tail_bench(st, &paxos::local_end::get_last_log); }
+
+    BENCHMARK(BM_get_first_hole)->ArgsProduct({ { 1000, 100000 }, { 0, 1, 64 } });
+    BENCHMARK(BM_get_last_log)->ArgsProduct({ { 1000, 100000 }, { 0, 1, 64 } });
+
+    // quorum membership of the latest slot after range(0) configuration changes
+    void BM_state_get_config(benchmark::State& st)
+    {
+        local_end_access::state s;
+        s.m_node_id = 0;
+        int log = 1;
+        for (int i = 0; i < st.range(0); ++i, ++log)
+        {
+            s.apply(log, paxos::value{ 1, {}, { 3 + 2 * i, 4 + 2 * i } });
+        }
+        for (auto _ : st)
+        {
+            benchmark::DoNotOptimize(s.get_config(log + 3));
+        }
+    }
+    BENCHMARK(BM_state_get_config)->Arg(0)->Arg(1)->Arg(16);
+
+    // applying purchases, with and without a client session to check
+    void BM_state_apply(benchmark::State& st)
+    {
+        local_end_access::state s;
+        s.m_node_id = 0;
+        std::vector<paxos::value> vals;
+        for (int i = 1; i <= 4096; ++i)
+        {
+            paxos::ticket_sell ts{ i % 5, 0 };
+            if (st.range(0))
+            {
+                ts.session = i % 64 + 1;
+                ts.request = i;
+            }
+            vals.emplace_back(0, ts);
+        }
+
+        int log = 1;
+        for (auto _ : st)
+        {
+            s.apply(log, vals[log % vals.size()]);
+            ++log;
+        }
+        st.SetItemsProcessed(st.iterations());
+    }
+    BENCHMARK(BM_state_apply)->Arg(0)->Arg(1);
+
+    // a heartbeat and its answer through remote_end within this process, range(0) 1 for shared memory
+    void BM_round_trip(benchmark::State& st)
+    {
+        auto heartbeat = [](int node, int period_ms) { return node + period_ms; };
+        if (st.range(0))
+        {
+            // the ports only name the segment
+            auto port = 40000 + 2 * next_id++;
+            auto d = std::make_shared<paxos::shm::dispatcher>(1);
+            d->bind("heartbeat", heartbeat);
+            auto near = std::make_shared<paxos::shm::link>(port, port + 1, d);
+            auto far = std::make_shared<paxos::shm::link>(port + 1, port, d);
+
+            paxos::remote_end peer("localhost", port + 1);
+            peer.set_link(near);
+            for (auto _ : st)
+            {
+                benchmark::DoNotOptimize(peer.heartbeat(1, 50).get());
+            }
+
+            // the last one to close removes the segment
+            near->close();
+            far->close();
+        }
+        else
+        {
+            rpc::server srv(0);
+            srv.bind("heartbeat", heartbeat);
+            srv.async_run(1);
+
+            paxos::remote_end peer("127.0.0.1", srv.port());
+            for (auto _ : st)
+            {
+                benchmark::DoNotOptimize(peer.heartbeat(1, 50).get());
+            }
+        }
+        st.SetItemsProcessed(st.iterations());
+    }
+    BENCHMARK(BM_round_trip)->Arg(0)->Arg(1)->UseRealTime();
+}
+
+int main(int argc, char** argv)
+{
+    // JSON by default, an explicit --benchmark_format still wins
+    std::vector<char*> args(argv, argv + argc);
+    char json[] = "--benchmark_format=json";
+    if (std::none_of(args.begin(), args.end(), [](char* a) { return std::strncmp(a, "--benchmark_format", 18) == 0; }))
+    {
+        args.insert(args.begin() + 1, json);
+    }
+
+    char dir[] = "/tmp/paxos_bench.XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) != 0)
+    {
+        std::perror("can't set up a scratch directory");
+        return 1;
+    }
+
+    spdlog::set_level(spdlog::level::warn);
+
+    int count = int(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+}
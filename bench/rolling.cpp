@@ -0,0 +1,276 @@
+#include <rpc/client.h>
+#include <rpc/rpc_error.h>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Client visible stall of a rolling restart.
+ * Usage: rolling_bench <path to paxos> [graceful|kill]
+ *
+ * Starts every node of ./config.json and keeps a client buying through
+ * them, then restarts every node in turn, the leader included. With
+ * graceful a node gets SIGTERM, so a leader hands over to a successor
+ * before it exits; with kill it's SIGKILLed and the others wait out its
+ * lease. For every restart the longest the client went without a
+ * successful purchase is reported, between the signal and a second
+ * after the node answers again.
+ */
+
+namespace
+{
+    using clk = std::chrono::steady_clock;
+
+    struct node
+    {
+        std::string host;
+        int port;
+        pid_t pid = -1;
+    };
+
+    pid_t spawn(const std::string& binary, int id)
+    {
+        auto pid = fork();
+        if (pid == 0)
+        {
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            auto id_str = std::to_string(id);
+            execl(binary.c_str(), binary.c_str(), id_str.c_str(), nullptr);
+            _exit(127);
+        }
+        return pid;
+    }
+
+    int ask_leader(const node& n)
+    {
+        try
+        {
+            rpc::client c(n.host, n.port);
+            c.set_timeout(50);
+            return c.call("get_leader").as<uint8_t>();
+        }
+        catch (std::exception&)
+        {
+            return 0xFF;
+        }
+    }
+
+    int find_leader(const std::vector<node>& nodes, std::chrono::milliseconds give_up)
+    {
+        auto began = clk::now();
+        while (clk::now() - began < give_up)
+        {
+            for (int i = 0; i < int(nodes.size()); ++i)
+            {
+                if (ask_leader(nodes[i]) == i)
+                {
+                    return i;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return -1;
+    }
+
+    // a node that doesn't exit on its own in time is killed
+    void stop(pid_t pid, int sig)
+    {
+        kill(pid, sig);
+        auto give_up = clk::now() + std::chrono::seconds(5);
+        while (clk::now() < give_up)
+        {
+            if (waitpid(pid, nullptr, WNOHANG) == pid)
+            {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+
+    // until the client endpoint of the node answers
+    bool wait_up(const node& n, std::chrono::milliseconds give_up)
+    {
+        auto began = clk::now();
+        while (clk::now() - began < give_up)
+        {
+            try
+            {
+                rpc::client c(n.host, n.port * 2);
+                c.set_timeout(100);
+                if (c.call("hb").as<bool>())
+                {
+                    return true;
+                }
+            }
+            catch (std::exception&)
+            {
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+
+    /*
+     * Buys zero tickets at a time, which goes through consensus all the same,
+     * following redirects and moving on to the next node when one fails.
+     * Kept under the admission rate, so a gap between two successes is
+     * the cluster's doing.
+     */
+    void buy_loop(const std::vector<node>& nodes, int client_id, const std::atomic<bool>& stop,
+                  std::mutex& prot, std::vector<clk::time_point>& done)
+    {
+        int target = 0;
+        for (int request = 1; !stop; ++request)
+        {
+            while (!stop)
+            {
+                try
+                {
+                    rpc::client c(nodes[target].host, nodes[target].port * 2);
+                    c.set_timeout(1000);
+                    auto id = c.call("buy", 0, client_id, client_id, request).as<uint8_t>();
+                    if (id == target)
+                    {
+                        std::lock_guard<std::mutex> lk{prot};
+                        done.push_back(clk::now());
+                        break;
+                    }
+                    target = id == 0xFF ? (target + 1) % int(nodes.size()) : id;
+                }
+                catch (rpc::rpc_error& err)
+                {
+                    auto [reason, retry_ms] = err.get_error().as<std::tuple<std::string, int>>();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
+                }
+                catch (std::exception&)
+                {
+                    target = (target + 1) % int(nodes.size());
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(25));
+        }
+    }
+
+    // the longest gap between two successes that overlaps the window
+    double worst_gap(const std::vector<clk::time_point>& done, clk::time_point from, clk::time_point to)
+    {
+        double res = 0;
+        for (size_t i = 1; i < done.size(); ++i)
+        {
+            if (done[i] < from || done[i - 1] > to) continue;
+            res = std::max(res, std::chrono::duration<double, std::milli>(done[i] - done[i - 1]).count());
+        }
+        return res;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <path to paxos> [graceful|kill]\n";
+        return 1;
+    }
+
+    const std::string binary = argv[1];
+    const bool graceful = !(argc > 2 && std::string(argv[2]) == "kill");
+
+    std::ifstream in("config.json");
+    nlohmann::json config;
+    in >> config;
+
+    std::vector<node> nodes;
+    for (auto& p : config["nodes"])
+    {
+        node n;
+        n.host = p["ip"].get<std::string>();
+        n.port = p["port"].get<int>();
+        nodes.push_back(n);
+    }
+
+    for (int i = 0; i < int(nodes.size()); ++i)
+    {
+        nodes[i].pid = spawn(binary, i);
+    }
+
+    auto shutdown = [&nodes] {
+        for (auto& n : nodes)
+        {
+            kill(n.pid, SIGKILL);
+            waitpid(n.pid, nullptr, 0);
+        }
+    };
+
+    if (find_leader(nodes, std::chrono::seconds(10)) == -1)
+    {
+        std::cerr << "no leader came up\n";
+        shutdown();
+        return 1;
+    }
+
+    std::random_device rd;
+    const int client_id = std::uniform_int_distribution<int>(1000, 1 << 30)(rd);
+    std::atomic<bool> stop_buying{false};
+    std::mutex prot;
+    std::vector<clk::time_point> done;
+    std::thread buyer([&] {
+        buy_loop(nodes, client_id, stop_buying, prot, done);
+    });
+
+    // settle on the leader's heartbeat period before the first restart
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+
+    struct restart
+    {
+        int node;
+        bool was_leader;
+        clk::time_point from, to;
+    };
+    std::vector<restart> restarts;
+
+    for (int i = 0; i < int(nodes.size()); ++i)
+    {
+        restart r{ i, ask_leader(nodes[i]) == i, clk::now(), {} };
+        stop(nodes[i].pid, graceful ? SIGTERM : SIGKILL);
+        nodes[i].pid = spawn(binary, i);
+        if (!wait_up(nodes[i], std::chrono::seconds(10)))
+        {
+            std::cerr << "node " << i << " didn't come back\n";
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        r.to = clk::now();
+        restarts.push_back(r);
+    }
+
+    stop_buying = true;
+    buyer.join();
+    shutdown();
+
+    double worst = 0;
+    std::printf("%s restart of %zu nodes, %zu purchases\n", graceful ? "graceful" : "kill", nodes.size(), done.size());
+    for (auto& r : restarts)
+    {
+        auto gap = worst_gap(done, r.from, r.to);
+        worst = std::max(worst, gap);
+        std::printf("node %d%s: longest stall %.1f ms\n", r.node, r.was_leader ? " (leader)" : "", gap);
+    }
+    std::printf("worst stall %.1f ms\n", worst);
+}
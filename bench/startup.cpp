@@ -0,0 +1,231 @@
+#include <paxos/log_store.hpp>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Startup time, peak memory and size on disk of an acceptor log of a
+ * given size in each format it had: one big map read into memory, bare
+ * [index, log_entry] records indexed in place, and the compressed blocks
+ * log_store writes now. Every load runs in a forked child so peak RSS is
+ * measured in isolation.
+ */
+
+namespace msgpack = RPCLIB_MSGPACK;
+using clk = std::chrono::steady_clock;
+
+namespace
+{
+    paxos::log_entry make_entry(int i)
+    {
+        paxos::log_entry e;
+        e.m_cur_bal = paxos::ballot{ 1, i % 5, i }.pack();
+        e.m_accept_bal = e.m_cur_bal;
+        e.m_val = paxos::value{ 0, { i % 5, 1 } };
+        e.m_commited = true;
+        return e;
+    }
+
+    void write_legacy(const std::string& path, int n)
+    {
+        std::map<int, paxos::log_entry> log;
+        for (int i = 1; i <= n; ++i)
+        {
+            log.emplace(i, make_entry(i));
+        }
+        msgpack::sbuffer sbuf;
+        msgpack::pack(sbuf, log);
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(sbuf.data(), sbuf.size());
+    }
+
+    void write_bare_records(const std::string& path, int n)
+    {
+        msgpack::sbuffer sbuf;
+        for (int i = 1; i <= n; ++i)
+        {
+            msgpack::pack(sbuf, std::make_tuple(i, make_entry(i)));
+        }
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(sbuf.data(), sbuf.size());
+    }
+
+    void write_blocks(const std::string& path, int n)
+    {
+        std::remove(path.c_str());
+        paxos::log_store store(path);
+        store.open();
+        for (int i = 1; i <= n; ++i)
+        {
+            store.append(i, make_entry(i));
+        }
+    }
+
+    long load_legacy(const std::string& path)
+    {
+        std::ifstream in(path);
+        std::string buffer((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        msgpack::unpacker pac;
+        pac.reserve_buffer(buffer.size());
+        std::copy(buffer.begin(), buffer.end(), pac.buffer());
+        pac.buffer_consumed(buffer.size());
+
+        msgpack::object_handle oh;
+        pac.next(oh);
+
+        std::map<int, paxos::log_entry> log;
+        oh.get().convert(log);
+
+        long sold = 0;
+        for (auto& l : log)
+        {
+            if (!l.second.m_commited) break;
+            sold += l.second.m_val.ts()->ticket_count;
+        }
+        return sold;
+    }
+
+    // what opening a log of bare records used to do: map, index, then decode in slot order
+    long load_bare_records(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        fstat(fd, &st);
+        auto size = size_t(st.st_size);
+        auto map = static_cast<const char*>(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+        close(fd);
+
+        std::vector<std::pair<size_t, size_t>> index;
+        for (size_t off = 0; off < size;)
+        {
+            auto begin = off;
+            auto oh = msgpack::unpack(map, size, off);
+            auto slot = oh.get().via.array.ptr[0].as<int>();
+            if (size_t(slot) >= index.size())
+            {
+                index.resize(slot + 1);
+            }
+            index[slot] = { begin, off - begin };
+        }
+
+        long sold = 0;
+        for (size_t i = 1; i < index.size(); ++i)
+        {
+            auto oh = msgpack::unpack(map + index[i].first, index[i].second);
+            paxos::log_entry e;
+            oh.get().via.array.ptr[1].convert(e);
+            if (!e.m_commited) break;
+            sold += e.m_val.ts()->ticket_count;
+        }
+        munmap(const_cast<char*>(map), size);
+        return sold;
+    }
+
+    long load_blocks(const std::string& path)
+    {
+        paxos::log_store store(path);
+        store.open();
+
+        long sold = 0;
+        for (int i = 1; i < store.end_index() && store.contains(i); ++i)
+        {
+            auto e = store.read(i);
+            if (!e.m_commited) break;
+            sold += e.m_val.ts()->ticket_count;
+        }
+        return sold;
+    }
+
+    struct result
+    {
+        double ms;
+        long peak_kb;
+    };
+
+    template <class LoadT>
+    result measure(LoadT load, const std::string& path)
+    {
+        int fds[2];
+        if (pipe(fds) != 0)
+        {
+            return { -1, -1 };
+        }
+
+        auto pid = fork();
+        if (pid == 0)
+        {
+            close(fds[0]);
+            auto began = clk::now();
+            volatile long sink = load(path);
+            (void)sink;
+            std::chrono::duration<double, std::milli> spent = clk::now() - began;
+
+            rusage ru{};
+            getrusage(RUSAGE_SELF, &ru);
+            result r{ spent.count(), ru.ru_maxrss };
+            write(fds[1], &r, sizeof r);
+            _exit(0);
+        }
+
+        close(fds[1]);
+        result r{ -1, -1 };
+        read(fds[0], &r, sizeof r);
+        close(fds[0]);
+        waitpid(pid, nullptr, 0);
+        return r;
+    }
+
+    long file_bytes(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        return long(in.tellg());
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<int> sizes{ 10000, 100000, 1000000 };
+    if (argc > 1)
+    {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i)
+        {
+            sizes.push_back(std::stoi(argv[i]));
+        }
+    }
+
+    const std::string legacy = "bench_legacy.mpk";
+    const std::string records = "bench_records.mpk";
+    const std::string blocks = "bench_blocks.mpk";
+
+    std::printf("%10s %8s %12s %14s %12s %14s\n",
+                "entries", "format", "bytes/entry", "file_kb", "load_ms", "peak_kb");
+    for (auto n : sizes)
+    {
+        write_legacy(legacy, n);
+        write_bare_records(records, n);
+        write_blocks(blocks, n);
+
+        auto row = [n](const char* name, const std::string& path, result r) {
+            auto bytes = file_bytes(path);
+            std::printf("%10d %8s %12.1f %14ld %12.1f %14ld\n",
+                        n, name, double(bytes) / n, bytes / 1024, r.ms, r.peak_kb);
+        };
+        row("map", legacy, measure(load_legacy, legacy));
+        row("records", records, measure(load_bare_records, records));
+        row("blocks", blocks, measure(load_blocks, blocks));
+    }
+
+    std::remove(legacy.c_str());
+    std::remove(records.c_str());
+    std::remove(blocks.c_str());
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <rpc/msgpack.hpp>
+#include <boost/optional.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+namespace paxos
+{
+    /*
+     * Gate in front of the client endpoints. At most max_inflight requests
+     * run consensus at a time and at most max_queue more wait for their
+     * turn; anything beyond that, or beyond a client's token bucket, is
+     * turned away right away with a hint on when to come back. A bucket
+     * left alone long enough to refill is as good as a new one and is
+     * dropped, so clients that come and go don't pile up.
+     */
+    class admission
+    {
+    public:
+        struct limits
+        {
+            int max_inflight = 1;
+            int max_queue = 32;
+            double client_rate = 50; // requests per second per client
+            double client_burst = 20;
+            std::chrono::milliseconds max_wait{2000};
+        };
+
+        struct stats
+        {
+            int depth = 0;
+            int inflight = 0;
+            int max_depth = 0;
+            int64_t admitted = 0;
+            int64_t rejected_overload = 0;
+            int64_t rejected_rate = 0;
+            int64_t timed_out = 0;
+            double service_ms = 0;
+            MSGPACK_DEFINE_MAP(depth, inflight, max_depth, admitted, rejected_overload, rejected_rate, timed_out, service_ms);
+        };
+
+        class ticket
+        {
+        public:
+            explicit ticket(admission* a) : m_gate(a), m_began(clock::now()) {}
+            ticket(ticket&& rhs) noexcept : m_gate(rhs.m_gate), m_began(rhs.m_began) { rhs.m_gate = nullptr; }
+            ticket(const ticket&) = delete;
+            ~ticket();
+
+        private:
+            admission* m_gate;
+            std::chrono::steady_clock::time_point m_began;
+        };
+
+        using clock = std::chrono::steady_clock;
+
+        explicit admission(limits l) : m_limits(l) {}
+
+        /*
+         * Waits for a consensus slot. On rejection returns no ticket and
+         * sets retry_after to how long the client should back off.
+         */
+        boost::optional<ticket> enter(int client_id, std::chrono::milliseconds& retry_after);
+
+        stats get_stats() const;
+
+    private:
+        void leave(clock::duration service);
+
+        std::chrono::milliseconds drain_estimate() const;
+
+        // drops the buckets that refilled since their last use, must hold m_prot
+        void evict_idle(clock::time_point now);
+
+        struct bucket
+        {
+            double tokens;
+            clock::time_point last;
+        };
+
+        limits m_limits;
+
+        mutable std::mutex m_prot;
+        std::condition_variable m_cv;
+        std::map<int, bucket> m_buckets;
+        clock::time_point m_last_evict = clock::now();
+        stats m_stats;
+    };
+}
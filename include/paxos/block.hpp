@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace paxos
+{
+namespace block
+{
+    enum class codec : uint8_t
+    {
+        none = 0,
+        lz4 = 1,  // cheap enough for every group commit
+        zstd = 2  // smaller, for data written once and kept: compacted logs and snapshots
+    };
+
+    /*
+     * Framing of everything the log store puts on disk: a fixed header and
+     * the payload, compressed or not. The checksum covers the header and
+     * the stored payload, so a torn or rotted block is caught before any
+     * of it is decoded.
+     */
+    struct header
+    {
+        char magic[4];
+        uint8_t codec;
+        uint8_t reserved[3];
+        uint32_t raw_size;
+        uint32_t stored_size;
+        uint32_t crc; // CRC32C of the fields above and the stored payload
+    };
+
+    constexpr size_t header_size = sizeof(header);
+    static_assert(header_size == 20, "the header is written as is");
+
+    // whether the bytes start with a block header
+    bool is_block(const char* data, size_t size);
+
+    /*
+     * Appends a block holding the payload to out. Stores it uncompressed
+     * if the codec isn't built in or doesn't make it any smaller.
+     */
+    void encode(codec c, const char* data, size_t size, std::string& out);
+
+    enum class status
+    {
+        ok,
+        short_read, // the header or the payload runs past the end of the data
+        bad_header, // no block starts here
+        bad_crc
+    };
+
+    struct view
+    {
+        codec c = codec::none;
+        const char* stored = nullptr;
+        uint32_t stored_size = 0;
+        uint32_t raw_size = 0;
+        size_t total = 0; // header and payload
+    };
+
+    /*
+     * Checks the block at the start of data and points the view at its
+     * payload. The sizes are filled in for a bad checksum too.
+     */
+    status parse(const char* data, size_t size, view& v);
+
+    // the payload of a parsed block, throws if it's compressed with a codec that isn't built in
+    void decode(const view& v, std::vector<char>& out);
+
+    uint32_t crc32c(const char* data, size_t size, uint32_t crc = 0);
+}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+namespace paxos
+{
+namespace erasure
+{
+    /*
+     * Systematic Reed-Solomon over GF(256). The first k fragments are the
+     * value cut into k equal pieces, the other n - k are parity rows of a
+     * Cauchy matrix, so any k distinct fragments give the value back.
+     * n is at most 256.
+     */
+    std::vector<std::vector<char>> encode(const char* data, size_t size, int k, int n);
+
+    // what every fragment of a value of the given size takes, the last piece is zero padded
+    size_t fragment_size(size_t size, int k);
+
+    /*
+     * Rebuilds a value of the given size from fragments keyed by their
+     * index, each fragment_size(size, k) long. Throws if there are fewer
+     * than k of them.
+     */
+    std::vector<char> decode(const std::map<int, const char*>& fragments, size_t size, int k, int n);
+}
+}
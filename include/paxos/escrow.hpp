@@ -0,0 +1,58 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace paxos
+{
+    /*
+     * This node's side of the ticket escrow: the number of tickets it ever
+     * sold from its quotas, kept on local disk only. Together with what the
+     * log granted and took back it tells how much quota is left, so it has
+     * to be durable before a sale is acknowledged or a restart could sell
+     * the same tickets again.
+     *
+     * Sales are counted right away and synced in groups: whoever waits
+     * first writes the total for everyone that counted theirs meanwhile.
+     */
+    class escrow_ledger
+    {
+    public:
+        explicit escrow_ledger(std::string path);
+
+        escrow_ledger(const escrow_ledger&) = delete;
+        escrow_ledger& operator=(const escrow_ledger&) = delete;
+
+        ~escrow_ledger();
+
+        // counted sales, durable or not
+        int64_t sold() const;
+
+        // what's on disk, the only total that may be reported to the log
+        int64_t durable() const;
+
+        // counts the sale, returns the total to wait() for
+        int64_t add_sold(int count);
+
+        /*
+         * Blocks until the total is durable, throws if the write that
+         * should have covered it failed. The sales stay counted then,
+         * they're lost to the pool but never sold twice.
+         */
+        void wait(int64_t total);
+
+    private:
+        std::string m_path;
+        int m_fd = -1;
+
+        mutable std::mutex m_prot;
+        std::condition_variable m_synced_cv;
+        int64_t m_sold = 0;
+        int64_t m_durable = 0;
+        int64_t m_failed = 0;
+        int m_error = 0;
+        bool m_syncing = false;
+    };
+}
@@ -4,75 +4,160 @@
 
 #pragma once
 
+#include <array>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
 #include <rpc/server.h>
 #include <boost/optional.hpp>
 #include <boost/utility/string_view.hpp>
 #include <paxos/paxos.hpp>
+#include <paxos/log_store.hpp>
+#include <paxos/escrow.hpp>
+#include <paxos/quorum.hpp>
+#include <paxos/shm.hpp>
 #include <spdlog/spdlog.h>
 
 namespace paxos
 {
 class remote_end;
+
+// lets the benchmarks reach the internals they measure
+struct local_end_access;
+
 class local_end {
+    friend struct local_end_access;
 public:
     using clock = std::chrono::high_resolution_clock;
-    explicit local_end(uint16_t port, int n_id);
+    /*
+     * A learner follows the log and serves reads but never votes, until a
+     * promote entry for it is applied.
+     */
+    explicit local_end(uint16_t port, int n_id, bool learner = false);
 
-    void add_endpoint(uint8_t node_id, boost::string_view host, uint16_t port);
+    void add_endpoint(uint8_t node_id, boost::string_view host, uint16_t port, bool learner = false);
 
     boost::optional<std::pair<paxos::ballot, paxos::value>> phase_one(const paxos::value& val, int log_index);
 
     bool phase_two(const std::pair<paxos::ballot, paxos::value>& p1res);
 
+    /*
+     * Runs consensus for the given value if this node is the leader or no
+     * leader is known. Otherwise the value is forwarded to the current leader
+     * over the peer connection. A forwarded value isn't forwarded again,
+     * the leader we know of is returned so the sender redirects its client.
+     * Returns the id of the node that handled the request, 0xFF on failure.
+     */
+    uint8_t propose(const paxos::value& val, bool forwarded = false);
+
     bool send_heartbeats();
 
+    /*
+     * Hands leadership to the given voter, or the one furthest along with
+     * 0xFF. New proposals wait while the successor is brought up to date,
+     * then it's told to run its election right away instead of waiting
+     * for this node's lease to run out; the waiting proposals go to it.
+     * Returns whether the successor took over.
+     */
+    bool transfer_leadership(uint8_t to = 0xFF);
+
     bool am_i_leader() const;
 
     paxos::remote_end* get_leader();
 
     uint8_t get_leader_id();
 
+    // how far behind the leader this node's view may be
+    std::chrono::milliseconds staleness() const;
+
     int get_first_hole() const
     {
-        if (m_log.size() == m_state.last_log)
-        {
-            return -1;
-        }
-
-        auto it = m_log.end();
-        --it;
-        while (it->second.m_commited)
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        for (auto it = m_log.rbegin(); it != m_log.rend(); ++it)
         {
-            --it;
+            std::lock_guard<std::mutex> slot_lk{stripe(it->first)};
+            if (!it->second.m_commited)
+            {
+                return it->first;
+            }
         }
-        return it->first;
+        return -1;
     }
 
     int get_last_log() const
     {
-        if (m_log.empty())
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        for (auto it = m_log.rbegin(); it != m_log.rend(); ++it)
         {
-            return 0;
-        }
-
-        auto it = m_log.end();
-        --it;
-        while (!it->second.m_commited)
-        {
-            if (it == m_log.begin())
+            std::lock_guard<std::mutex> slot_lk{stripe(it->first)};
+            if (it->second.m_commited)
             {
-                return 0;
+                return it->first;
             }
-            --it;
         }
-        return it->first;
+        // everything committed before a restart stays on disk until needed
+        return m_state.last_log;
     }
 
+    void set_durability(log_store::durability mode, std::chrono::microseconds window);
+
+    // caps what the bulk lane sends to catching up nodes, 0 lifts the cap
+    void set_bulk_rate(int64_t bytes_per_sec);
+
+    /*
+     * Blobs of at least min_size are erasure coded into one fragment per
+     * voter, any k of which rebuild them. Quorums grow so that any two
+     * share k acceptors. 1 replicates whole values.
+     */
+    void set_erasure(int k, size_t min_size);
+
+    /*
+     * Acceptors a leader change and a commit need, counting the leader;
+     * 0 is a majority. Phase one is raised whenever q1 + q2 doesn't exceed
+     * the voters of a round.
+     */
+    void set_quorums(int phase_one, int phase_two);
+
+    /*
+     * Lets this node sell from a quota held in escrow, asking the log for
+     * grant tickets at a time whenever it runs out. 0 turns it off.
+     */
+    void set_escrow(int grant);
+
+    /*
+     * Peers added from then on that run on this machine get control calls
+     * over shared memory instead of TCP loopback. On by default.
+     */
+    void set_shared_memory(bool on);
+
+    /*
+     * Sells from this node's quota without a consensus round. A background
+     * round asks the log for more once it's half gone, a sale that doesn't
+     * fit waits for one. Returns false if there is no quota to be had; what
+     * was left of it goes back to the pool then so the purchase can still
+     * go through the log.
+     */
+    bool sell_local(int count);
+
+    /*
+     * Polls the peers for the current leader, catches up with it and starts
+     * the election thread which takes over when the leader goes silent.
+     */
     void detect_leader();
     uint8_t discover_leader() const;
 
-    void show(std::ostream& to);
+    paxos::summary summary();
+
+    /*
+     * Committed entries starting at the cursor, at most limit of them. The
+     * returned page carries the cursor to continue from. The work done per
+     * call is bounded by the limit, not the length of the log.
+     */
+    paxos::log_page log_range(int cursor, int limit);
 
     void learn_log();
 
@@ -80,11 +165,132 @@ public:
 
 private:
 
-    void start_hb_thread();
+    // serves the call on the control lane, over TCP and over shared memory alike
+    template <class F>
+    void bind_control(const std::string& name, F fn);
 
-    void dump_log();
+    void start_hb_thread();
+    void start_election_thread();
+
+    /*
+     * Asks the voters whether they'd support an election without touching
+     * their state. Nodes that still hear from a leader refuse, so a node
+     * that was partitioned away can't depose a healthy leader.
+     */
+    bool pre_vote();
+
+    // runs phase one and two with a no-op on the next free slot
+    void run_election();
+
+    /*
+     * The leader asked us to succeed it. Runs the election at once if we
+     * have everything it committed up to last_log, returns whether we won.
+     */
+    bool take_over(uint8_t from, int last_log);
+
+    // the voter that acknowledged the most of the log, 0xFF if there's none
+    uint8_t pick_successor();
+
+    // heartbeat period and the timeouts derived from it
+    clock::duration hb_period() const;
+    clock::duration leader_lease() const;
+    clock::duration follower_timeout() const;
+
+    /*
+     * Queues the slot for persistence, returns the sequence number to wait
+     * on before replying. Must be called with m_log_prot held, and the
+     * slot's stripe too if that's only shared.
+     */
+    uint64_t dump_log(int index);
     void load_log();
 
+    /*
+     * Returns the in memory entry of the slot, bringing it in from the
+     * recovered on disk log first if it hasn't been touched since startup.
+     * Must be called with m_log_prot held.
+     */
+    log_entry& entry(int index);
+
+    /*
+     * entry() for a holder of the shared m_log_prot. A slot that isn't in
+     * memory yet is brought in under the exclusive lock, so lk is let go
+     * for a moment then. Lock the slot's stripe before touching it.
+     */
+    log_entry& shared_entry(int index, std::shared_lock<std::shared_mutex>& lk);
+
+    // serializes the acceptor requests of the slots that hash to it
+    std::mutex& stripe(int index) const;
+
+    std::vector<uint8_t> get_config(int for_log) const;
+
+    // the quorum sizes rounds are checked against right now
+    paxos::quorums quorum_sizes() const;
+
+    /*
+     * Collects fragments of a committed coded slot from the other voters
+     * and puts the rebuilt blob in place of our fragment.
+     */
+    boost::optional<paxos::blob> rebuild(int index, const paxos::fragment& mine);
+
+    /*
+     * At most limit committed entries from the given slot on. With accepted,
+     * slots that hold a value this node accepted under its own ballot come
+     * along too.
+     */
+    std::map<int, log_entry> get_committed(int from, int limit, bool accepted = false);
+
+    /*
+     * Applies the committed run right after the state, which needs no
+     * remote call. Must be called with m_log_prot held.
+     */
+    void apply_committed();
+
+    // wakes the catch up thread, which runs learn_log off the control lane
+    void request_catch_up();
+
+    // blocks the calling bulk worker until the rate allows sending that much
+    void bulk_throttle(size_t bytes);
+
+    /*
+     * Records what a follower reported applied, and what it should have had
+     * applied by then, and wakes the replicator if it's behind.
+     */
+    void note_progress(uint8_t node, int applied, int owed);
+
+    /*
+     * One round of the leader's replicator: collects acknowledged batches
+     * and sends the next ones to followers that are behind. Returns whether
+     * there are batches in flight.
+     */
+    bool replicate();
+
+    /*
+     * Takes entries pushed by the leader. Committed ones are merged and
+     * applied, accepted ones go through accept. Returns the last applied
+     * slot, -1 if the sender isn't our leader.
+     */
+    int receive_push(uint8_t from, const std::map<int, log_entry>& entries);
+
+    /*
+     * The slot a retried purchase was already decided in, looking at the
+     * applied state and the committed tail that isn't applied yet.
+     */
+    boost::optional<int> find_decided(const paxos::value& val) const;
+
+    /*
+     * Serves a piece of the snapshot taken at last_log. A last_log of -1
+     * starts a new transfer from the current state. If the requested
+     * snapshot was replaced in the meantime the chunk carries the new
+     * last_log and no data, and the transfer has to start over.
+     */
+    paxos::snapshot_chunk get_snapshot(int last_log, uint64_t offset);
+
+    /*
+     * Pulls the snapshot from the given node in chunks, persists it and
+     * replaces the local state with it if it's ahead of us.
+     */
+    bool install_snapshot(paxos::remote_end& from);
+
     paxos::promise prepare(paxos::ballot bal);
 
     bool accept(paxos::ballot bal, paxos::value val);
@@ -96,7 +302,77 @@ private:
     std::atomic<uint8_t> m_curr_leader = 0xFF;
     std::atomic<bool> m_running = false;
 
+    // tuned by the leader from measured round trips and sent with heartbeats
+    std::atomic<int> m_hb_period_ms = 50;
+    std::atomic<int> m_rtt_us = 0;
+
+    // retries answered without a new consensus round
+    std::atomic<int> m_deduplicated = 0;
+
+    std::atomic<int> m_erasure_k = 1;
+    std::atomic<int> m_phase_one_quorum = 0;
+    std::atomic<int> m_phase_two_quorum = 0;
+    std::atomic<size_t> m_erasure_min = 4096;
+    std::atomic<uint64_t> m_sent_bytes = 0;
+
+    std::mutex m_propose_prot;
+
+    /*
+     * Protects m_log and m_state, never held across a remote call or a disk
+     * wait. Acceptor requests hold it shared and lock the stripe of their
+     * slot, so requests for different slots run side by side; anything
+     * that adds or drops slots, or changes m_state, holds it exclusively.
+     * Readers hold it shared, and lock a slot's stripe to look inside it.
+     */
+    mutable std::shared_mutex m_log_prot;
+
+    static constexpr int slot_stripes = 64;
+    mutable std::array<std::mutex, slot_stripes> m_stripes;
+
+    // latency critical control lane: heartbeats, votes and decisions
     rpc::server m_server;
+    uint16_t m_port;
+
+    // the control lane of co-located peers, its workers run the same calls as m_server
+    std::atomic<bool> m_shm_on = true;
+    std::shared_ptr<shm::dispatcher> m_shm;
+    std::vector<std::shared_ptr<shm::link>> m_links;
+
+    // log and snapshot transfers on port * 3, with their own workers and a rate cap
+    rpc::server m_bulk_server;
+    std::mutex m_bulk_prot;
+    std::atomic<int64_t> m_bulk_rate = 0;
+    double m_bulk_tokens = 0;
+    clock::time_point m_bulk_refill;
+
+    std::thread m_catch_up_thread;
+    std::mutex m_catch_up_prot;
+    std::condition_variable m_catch_up_cv;
+    bool m_catch_up_pending = false;
+
+    // the leader's view of a follower, next and inflight are the replicator's alone
+    struct progress
+    {
+        int match = -1;
+        int owed = -1;
+        int next = 0;
+
+        // batches allowed in flight, grows with every ack and drops to one on trouble
+        int window = 1;
+        clock::time_point retry_at;
+
+        struct batch
+        {
+            int first;
+            std::future<int> ack;
+        };
+        std::deque<batch> inflight;
+    };
+
+    std::mutex m_repl_prot;
+    std::condition_variable m_repl_cv;
+    std::map<uint8_t, progress> m_progress;
+    std::thread m_repl_thread;
 
     struct state
     {
@@ -105,10 +381,48 @@ private:
         int sold_tickets = 0;
 
         void apply(int log, const value& v);
+
+        // every voter for the given slot, including this node
+        std::vector<uint8_t> members(int for_log) const;
+
+        // the voters other than this node
         std::vector<uint8_t> get_config(int for_log) const;
 
+        paxos::snapshot take_snapshot() const;
+        void restore(const paxos::snapshot& snap);
+
+        // the slot the purchase was decided in, if it was applied already
+        boost::optional<int> decided(const ticket_sell& ts) const;
+
+        struct escrow
+        {
+            int granted = 0;
+            int returned = 0;
+            int reported = 0;
+        };
+
+        escrow escrow_of(int node) const;
+
+        // tickets out in quotas that weren't reported sold yet
+        int escrowed() const;
+
+        bool promoted(int node) const;
+
     private:
 
+        std::vector<std::pair<int, int>> m_promotions;
+
+        std::map<int, escrow> m_escrow;
+
+        struct session
+        {
+            int request = 0;
+            int log_index = 0;
+        };
+
+        // latest request of every client session, idle sessions are dropped
+        std::map<int, session> m_sessions;
+
         struct chg
         {
             int log_index;
@@ -119,13 +433,61 @@ private:
 
     state m_state;
 
-    std::map<int, log_entry> m_log;
+    // this node's escrow as far as the log got, takes m_log_prot
+    state::escrow own_escrow() const;
+
+    // what this node can still sell from its quota, must hold m_escrow_prot
+    int quota_left(const state::escrow& e) const;
+
+    // proposes grants, and returns when the pool is dry, off the sales path
+    void refill_loop();
+
+    // false while this node is an unpromoted learner, must hold m_log_prot
+    bool voter() const;
+
+    // learners that aren't voters for the slot yet, committed entries are pushed to them
+    std::vector<uint8_t> learners(int for_log) const;
+
+    const bool m_learner;
+    std::vector<uint8_t> m_learners;
+
+    // slots up to here were folded into a snapshot and may be missing from the log
+    int m_snap_base = 0;
+
+    // the serialized snapshot being handed out to catching up nodes
+    std::mutex m_snap_prot;
+    int m_snap_last_log = -1;
+    std::shared_ptr<const std::vector<char>> m_snap_bytes;
+
+    log_map m_log;
+    log_store m_store;
 
     uint8_t m_node_id = 0;
 
     std::shared_ptr<spdlog::logger> m_l;
 
     std::thread m_hb_thread;
+    std::once_flag m_hb_once;
+
+    std::thread m_election_thread;
+    std::mt19937 m_rng;
+
+    // serializes local sales against quota changes
+    std::mutex m_escrow_prot;
+    std::atomic<int> m_escrow_grant = 0;
+    std::unique_ptr<escrow_ledger> m_ledger;
+
+    // returns we asked for, they count as gone before the log applies them
+    int m_return_requested = 0;
+
+    // all under m_escrow_prot, the cv wakes both the refill thread and sales waiting on it
+    std::thread m_refill_thread;
+    std::condition_variable m_refill_cv;
+    bool m_refill_wanted = false;
+    bool m_refilling = false;
+    bool m_refill_dry = false; // the last round got nothing, only a sale that doesn't fit asks again
+    int m_refill_short = 0;    // the biggest sale waiting for a round
+    uint64_t m_refills = 0;    // rounds finished
 };
 }
 
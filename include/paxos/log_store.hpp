@@ -0,0 +1,177 @@
+#pragma once
+
+#include <paxos/paxos.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+namespace paxos
+{
+    /*
+     * On disk acceptor log. The file is an append only stream of checksummed
+     * blocks (see block.hpp), each holding [index, cur_bal, accept_bal,
+     * committed, value] msgpack records; the last record of a slot wins.
+     * Every flush is one LZ4 block, compaction writes zstd blocks. Logs of
+     * bare [index, log_entry] records from before, and the single map the
+     * log used to be dumped as, are converted on open.
+     *
+     * On open the existing file is memory mapped and only indexed; entries
+     * are decoded from the mapping when somebody asks for them, going
+     * through a few decompressed blocks kept around, so the cold part of
+     * the history is never put in a map.
+     *
+     * Appends are handed to a persistence thread which batches them into a
+     * single write and fdatasync, through io_uring when it's available.
+     */
+    class log_store
+    {
+    public:
+        enum class durability
+        {
+            none,   // nothing is synced, waiting returns right away
+            per_op, // every record gets its own write and fdatasync
+            group   // records queued within the window share one write and fdatasync
+        };
+
+        explicit log_store(std::string path);
+
+        log_store(const log_store&) = delete;
+        log_store& operator=(const log_store&) = delete;
+
+        ~log_store();
+
+        /*
+         * Maps the current file and builds the slot index. If most of the
+         * records are stale, the live ones are copied to a fresh file first.
+         * A torn block at the end is cut off if there are intact ones
+         * before it. Damage anywhere else throws, as does a file in no
+         * format it knows.
+         */
+        void open();
+
+        bool contains(int index) const
+        {
+            return index >= 0 && size_t(index) < m_index.size() && m_index[index].length != 0;
+        }
+
+        /*
+         * Decodes the recovered entry of the given slot from the mapping.
+         * Only slots that were on disk at open() time are visible here.
+         */
+        log_entry read(int index) const;
+
+        // one past the highest recovered slot
+        int end_index() const { return int(m_index.size()); }
+
+        size_t record_count() const { return m_records; }
+
+        // what the persistence thread wrote since open, headers included
+        uint64_t bytes_written() const { return m_bytes_written; }
+
+        void set_durability(durability mode, std::chrono::microseconds window);
+
+        /*
+         * Queues the record for the persistence thread, returns the sequence
+         * number to pass to wait().
+         */
+        uint64_t append(int index, const log_entry& entry);
+
+        /*
+         * Blocks until the record with the given sequence number is durable
+         * under the current mode, throws if writing it failed.
+         */
+        void wait(uint64_t seq);
+
+        /*
+         * Replaces the state snapshot kept next to the log, the slots it
+         * covers don't need to be replayed on the next start. It's stored as
+         * a zstd block. Throws if the snapshot couldn't be made durable.
+         */
+        void save_snapshot(const std::vector<char>& bytes);
+
+        // the last saved snapshot, empty if there is none. Throws if it's damaged
+        std::vector<char> load_snapshot() const;
+
+    private:
+        struct block_info
+        {
+            size_t offset = 0; // of the stored payload in the mapping
+            uint32_t stored_size = 0;
+            uint32_t raw_size = 0;
+            uint8_t codec = 0;
+        };
+
+        // a record within the decoded payload of a block
+        struct span
+        {
+            uint32_t block = 0;
+            uint32_t length = 0;
+            size_t offset = 0;
+        };
+
+        struct writer;
+
+        void flush_loop();
+        void publish(uint64_t seq);
+
+        void map();
+        void unmap();
+        void build_index();
+
+        // replaces a log dumped as one map with blocks, throws if it can't be read or written
+        void convert_dumped_map();
+
+        // indexes the records of a payload, returns how many bytes of it were good records
+        size_t index_records(uint32_t block, const char* data, size_t size);
+
+        // rewrites the live records into zstd blocks, false if it didn't work out
+        bool compact();
+
+        /*
+         * The decoded payload of a block. Uncompressed ones are read from
+         * the mapping, the returned pointer keeps a decompressed one alive.
+         */
+        std::shared_ptr<const std::vector<char>> payload(uint32_t block, const char*& data) const;
+
+        std::string m_path;
+        int m_fd = -1;
+
+        const char* m_map = nullptr;
+        size_t m_map_size = 0;
+
+        std::vector<block_info> m_blocks;
+        std::vector<span> m_index;
+        size_t m_live = 0;
+        size_t m_records = 0;
+
+        // the file predates blocks, it's one big uncompressed payload
+        bool m_legacy = false;
+
+        mutable std::mutex m_cache_prot;
+        mutable std::vector<std::pair<uint32_t, std::shared_ptr<const std::vector<char>>>> m_cache;
+
+        std::atomic<uint64_t> m_bytes_written{0};
+
+        std::atomic<durability> m_mode{durability::group};
+        std::atomic<std::chrono::microseconds> m_window{std::chrono::microseconds(200)};
+
+        std::mutex m_queue_prot;
+        std::condition_variable m_queue_cv;
+        std::condition_variable m_durable_cv;
+        std::vector<std::string> m_pending;
+        uint64_t m_queued = 0;
+        uint64_t m_durable = 0;
+        int m_error = 0;
+        bool m_stopping = false;
+
+        off_t m_write_off = 0;
+        std::unique_ptr<writer> m_writer;
+        std::thread m_flush_thread;
+    };
+}
@@ -6,9 +6,15 @@
 
 #include <fmt/ostream.h>
 #include <rpc/msgpack.hpp>
+#include <paxos/slab.hpp>
+#include <cstring>
+#include <memory>
 #include <ostream>
+#include <string>
 #include <vector>
 #include <tuple>
+#include <map>
+#include <variant>
 
 namespace paxos {
     struct ballot {
@@ -28,15 +34,34 @@ namespace paxos {
 
         bool operator>=(const ballot& rhs) const;
 
+        /*
+         * A log entry already knows its own index, so only the number and
+         * the node id are kept when storing a ballot in the log.
+         */
+        constexpr uint64_t pack() const
+        {
+            return (uint64_t(uint32_t(number)) << 32) | uint32_t(node_id);
+        }
+
+        static constexpr ballot unpack(uint64_t bits, int log_index)
+        {
+            return { int(uint32_t(bits >> 32)), int(uint32_t(bits)), log_index };
+        }
+
         friend std::ostream& operator<<(std::ostream& os, const ballot& b);
     };
 
     struct ticket_sell {
         int client_id;
         int ticket_count;
-        MSGPACK_DEFINE_MAP(client_id, ticket_count);
+
+        // a retried purchase keeps its request id, session 0 opts out of deduplication
+        int session = 0;
+        int request = 0;
+        MSGPACK_DEFINE_MAP(client_id, ticket_count, session, request);
 
         bool operator!=(const ticket_sell& rhs) const;
+        bool operator==(const ticket_sell& rhs) const;
 
         friend std::ostream& operator<<(std::ostream& os, const ticket_sell& ts);
     };
@@ -47,24 +72,129 @@ namespace paxos {
         MSGPACK_DEFINE_MAP(new_node1, new_node2);
 
         bool operator!=(const config_chg& rhs) const;
+        bool operator==(const config_chg& rhs) const;
         friend std::ostream& operator<<(std::ostream& os, const config_chg& cc);
     };
 
+    /*
+     * Moves tickets between the shared pool and a node's escrow. A positive
+     * delta grants quota the node may sell on its own, a negative one gives
+     * it back. sold is the total the node ever sold from its quotas, only
+     * what's beyond the last report counts, so a report that's repeated or
+     * decided late doesn't count twice.
+     */
+    struct quota {
+        int node_id;
+        int delta;
+        int sold;
+        MSGPACK_DEFINE_MAP(node_id, delta, sold);
+
+        bool operator!=(const quota& rhs) const;
+        bool operator==(const quota& rhs) const;
+        friend std::ostream& operator<<(std::ostream& os, const quota& q);
+    };
+
+    // turns a learner into a voter
+    struct promote {
+        int node_id;
+        MSGPACK_DEFINE_MAP(node_id);
+
+        bool operator!=(const promote& rhs) const;
+        bool operator==(const promote& rhs) const;
+        friend std::ostream& operator<<(std::ostream& os, const promote& p);
+    };
+
+    /*
+     * Opaque command bytes. The buffer is immutable and shared, so copying
+     * a value that carries one only bumps a reference count. The bytes are
+     * copied once when they're decoded and never again on their way
+     * through the proposal pipeline or into the log.
+     */
+    struct blob {
+        std::shared_ptr<const std::vector<char>> bytes;
+
+        blob() = default;
+        explicit blob(std::vector<char> data);
+
+        const char* data() const { return bytes ? bytes->data() : nullptr; }
+        size_t size() const { return bytes ? bytes->size() : 0; }
+
+        bool operator!=(const blob& rhs) const;
+        bool operator==(const blob& rhs) const;
+        friend std::ostream& operator<<(std::ostream& os, const blob& b);
+    };
+
+    /*
+     * One of the n erasure coded pieces of a blob, any k of them rebuild
+     * it. Every acceptor of a coded slot holds a different one.
+     */
+    struct fragment {
+        int index = 0;
+        int k = 1;
+        int n = 1;
+        uint32_t size = 0; // of the whole blob
+        blob bytes;
+        MSGPACK_DEFINE_MAP(index, k, n, size, bytes);
+
+        bool operator!=(const fragment& rhs) const;
+        bool operator==(const fragment& rhs) const;
+        friend std::ostream& operator<<(std::ostream& os, const fragment& f);
+    };
+
+    /*
+     * A fragment as a value stores it, behind a shared pointer so the
+     * biggest alternative doesn't set the size of every log entry. On the
+     * wire it's the fragment itself.
+     */
+    struct coded {
+        std::shared_ptr<const fragment> frag;
+
+        bool operator!=(const coded& rhs) const;
+        bool operator==(const coded& rhs) const;
+        friend std::ostream& operator<<(std::ostream& os, const coded& c);
+    };
+
+    /*
+     * A command in the log. Exactly one of the alternatives is stored, the
+     * wire format is [type, payload] where type is the alternative index - 1
+     * so the null value keeps its old type of -1.
+     */
     struct value {
-        int type;
-        ticket_sell ts;
-        config_chg cc;
-        MSGPACK_DEFINE_MAP(type, ts, cc);
+        using data_type = std::variant<std::monostate, ticket_sell, config_chg, quota, promote, blob, coded>;
+        data_type data;
 
-        value();
+        value() = default;
 
         value(int, ticket_sell tsell);
 
         value(int, ticket_sell, config_chg cchg);
 
+        explicit value(quota q);
+
+        explicit value(promote p);
+
+        explicit value(blob b);
+
+        explicit value(fragment f);
+
+        int type() const { return int(data.index()) - 1; }
+
+        const ticket_sell* ts() const { return std::get_if<ticket_sell>(&data); }
+        const config_chg* cc() const { return std::get_if<config_chg>(&data); }
+        const quota* qt() const { return std::get_if<quota>(&data); }
+        const promote* pr() const { return std::get_if<promote>(&data); }
+        const paxos::blob* bl() const { return std::get_if<paxos::blob>(&data); }
+        const paxos::fragment* fr() const
+        {
+            auto c = std::get_if<paxos::coded>(&data);
+            return c ? c->frag.get() : nullptr;
+        }
+
         bool operator!=(const value& rhs) const;
 
         bool operator==(const value& rhs) const;
+
+        friend std::ostream& operator<<(std::ostream& os, const value& v);
     };
 
     struct promise {
@@ -81,11 +211,276 @@ namespace paxos {
 
     struct log_entry
     {
-        paxos::ballot m_cur_bal = { 0, -1 };
-        paxos::ballot m_accept_bal = { 0, -1 };
+        uint64_t m_cur_bal = ballot{ 0, -1 }.pack();
+        uint64_t m_accept_bal = ballot{ 0, -1 }.pack();
         paxos::value m_val;
         bool m_commited = false;
         MSGPACK_DEFINE_MAP(m_cur_bal, m_accept_bal, m_val, m_commited);
+
+        ballot cur_bal(int log_index) const { return ballot::unpack(m_cur_bal, log_index); }
+        ballot accept_bal(int log_index) const { return ballot::unpack(m_accept_bal, log_index); }
+    };
+
+    // m_log holds one per slot, a new alternative that grows this belongs behind a pointer like coded
+    static_assert(sizeof(log_entry) <= 48, "log entries grew");
+
+    /*
+     * Point in time copy of the replicated state, every slot up to and
+     * including last_log is folded in. A node holding it only needs the
+     * log after last_log to catch up.
+     */
+    struct snapshot
+    {
+        int last_log = 0;
+        int sold_tickets = 0;
+        std::vector<std::pair<int, config_chg>> changes;
+
+        // session, last request id, slot it was decided in
+        std::vector<std::tuple<int, int, int>> sessions;
+
+        // node, granted, returned, reported sold
+        std::vector<std::tuple<int, int, int, int>> escrow;
+
+        // slot, learner that became a voter
+        std::vector<std::pair<int, int>> promotions;
+        MSGPACK_DEFINE_MAP(last_log, sold_tickets, changes, sessions, escrow, promotions);
+    };
+
+    // a slice of a serialized snapshot, taken when last_log was applied
+    struct snapshot_chunk
+    {
+        int last_log = -1;
+        uint64_t offset = 0;
+        uint64_t total = 0;
+        std::vector<char> data;
+        MSGPACK_DEFINE_MAP(last_log, offset, total, data);
+    };
+
+    // what monitoring polls, cheap to produce no matter how long the log is
+    struct summary
+    {
+        int node_id = -1;
+        int leader = 0xFF;
+        int sold_tickets = 0;
+        int applied = 0;       // the last slot reflected in sold_tickets
+        int snapshot_base = 0; // slots up to here may only exist in a snapshot
+        int log_end = 0;       // one past the highest slot this node has seen
+        int deduplicated = 0;  // retries answered from the session table since startup
+        int escrowed = 0;      // tickets out in node quotas, some of them may be sold already
+        bool learner = false;  // doesn't vote, only follows the log
+        int staleness_ms = 0;  // since this node last heard from the leader, 0 on the leader
+        uint64_t sent_bytes = 0; // command payload sent to peers since startup
+        MSGPACK_DEFINE_MAP(node_id, leader, sold_tickets, applied, snapshot_base, log_end, deduplicated, escrowed,
+                           learner, staleness_ms, sent_bytes);
+    };
+
+    // a page of committed entries in slot order
+    struct log_page
+    {
+        std::vector<std::pair<int, value>> entries;
+        int next = -1; // cursor for the following page, -1 once the end is reached
+        MSGPACK_DEFINE_MAP(entries, next);
     };
+
+    using log_map = std::map<int, log_entry, std::less<int>, slab_allocator<std::pair<const int, log_entry>>>;
 }
 
+namespace RPCLIB_MSGPACK {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+    // written straight from the shared buffer, decoded into a new one
+    template <>
+    struct convert<paxos::blob> {
+        const object& operator()(const object& o, paxos::blob& v) const
+        {
+            if (o.type != type::BIN)
+            {
+                throw type_error();
+            }
+            v = paxos::blob(std::vector<char>(o.via.bin.ptr, o.via.bin.ptr + o.via.bin.size));
+            return o;
+        }
+    };
+
+    template <>
+    struct pack<paxos::blob> {
+        template <class Stream>
+        packer<Stream>& operator()(packer<Stream>& o, const paxos::blob& v) const
+        {
+            o.pack_bin(uint32_t(v.size()));
+            o.pack_bin_body(v.data(), uint32_t(v.size()));
+            return o;
+        }
+    };
+
+    template <>
+    struct object_with_zone<paxos::blob> {
+        void operator()(object::with_zone& o, const paxos::blob& v) const
+        {
+            auto ptr = static_cast<char*>(o.zone.allocate_align(v.size()));
+            if (v.size() != 0)
+            {
+                std::memcpy(ptr, v.data(), v.size());
+            }
+            o.type = type::BIN;
+            o.via.bin.ptr = ptr;
+            o.via.bin.size = uint32_t(v.size());
+        }
+    };
+
+    /*
+     * Entries from before packed ballots keep them as {number, node_id,
+     * log_index} maps, older logs and peers still decode. Packing always
+     * writes the current form.
+     */
+    template <>
+    struct convert<paxos::log_entry> {
+        const object& operator()(const object& o, paxos::log_entry& v) const
+        {
+            if (o.type != type::MAP)
+            {
+                throw type_error();
+            }
+            auto bits = [](const object& b) {
+                return b.type == type::MAP ? b.as<paxos::ballot>().pack() : b.as<uint64_t>();
+            };
+            for (uint32_t i = 0; i < o.via.map.size; ++i)
+            {
+                auto& kv = o.via.map.ptr[i];
+                auto key = kv.key.as<std::string>();
+                if (key == "m_cur_bal") v.m_cur_bal = bits(kv.val);
+                else if (key == "m_accept_bal") v.m_accept_bal = bits(kv.val);
+                else if (key == "m_val") kv.val.convert(v.m_val);
+                else if (key == "m_commited") kv.val.convert(v.m_commited);
+            }
+            return o;
+        }
+    };
+
+    template <>
+    struct convert<paxos::coded> {
+        const object& operator()(const object& o, paxos::coded& v) const
+        {
+            v.frag = std::make_shared<const paxos::fragment>(o.as<paxos::fragment>());
+            return o;
+        }
+    };
+
+    template <>
+    struct pack<paxos::coded> {
+        template <class Stream>
+        packer<Stream>& operator()(packer<Stream>& o, const paxos::coded& v) const
+        {
+            return o.pack(v.frag ? *v.frag : paxos::fragment{});
+        }
+    };
+
+    template <>
+    struct object_with_zone<paxos::coded> {
+        void operator()(object::with_zone& o, const paxos::coded& v) const
+        {
+            object_with_zone<paxos::fragment>()(o, v.frag ? *v.frag : paxos::fragment{});
+        }
+    };
+
+    namespace detail {
+        template <std::size_t I = 0>
+        void convert_alternative(const object& o, std::size_t index, paxos::value::data_type& v)
+        {
+            if constexpr (I < std::variant_size_v<paxos::value::data_type>)
+            {
+                if (index != I)
+                {
+                    return convert_alternative<I + 1>(o, index, v);
+                }
+
+                auto& alt = v.template emplace<I>();
+                if constexpr (!std::is_same_v<std::decay_t<decltype(alt)>, std::monostate>)
+                {
+                    o.convert(alt);
+                }
+            }
+            else
+            {
+                v = std::monostate{};
+            }
+        }
+    }
+
+    template <>
+    struct convert<paxos::value> {
+        const object& operator()(const object& o, paxos::value& v) const
+        {
+            if (o.type == type::MAP)
+            {
+                // {type, ts, cc}, from before the variant: both payloads were always there
+                int t = -1;
+                const object* ts = nullptr;
+                const object* cc = nullptr;
+                for (uint32_t i = 0; i < o.via.map.size; ++i)
+                {
+                    auto& kv = o.via.map.ptr[i];
+                    auto key = kv.key.as<std::string>();
+                    if (key == "type") t = kv.val.as<int>();
+                    else if (key == "ts") ts = &kv.val;
+                    else if (key == "cc") cc = &kv.val;
+                }
+                if (t == 0 && ts) v = paxos::value{ 0, ts->as<paxos::ticket_sell>() };
+                else if (t == 1 && cc) v = paxos::value{ 1, {}, cc->as<paxos::config_chg>() };
+                else v = paxos::value{};
+                return o;
+            }
+            if (o.type != type::ARRAY || o.via.array.size != 2)
+            {
+                throw type_error();
+            }
+            auto index = o.via.array.ptr[0].as<int>() + 1;
+            detail::convert_alternative(o.via.array.ptr[1], std::size_t(index), v.data);
+            return o;
+        }
+    };
+
+    template <>
+    struct pack<paxos::value> {
+        template <class Stream>
+        packer<Stream>& operator()(packer<Stream>& o, const paxos::value& v) const
+        {
+            o.pack_array(2);
+            o.pack(v.type());
+            std::visit([&o](const auto& alt) {
+                if constexpr (std::is_same_v<std::decay_t<decltype(alt)>, std::monostate>)
+                {
+                    o.pack_nil();
+                }
+                else
+                {
+                    o.pack(alt);
+                }
+            }, v.data);
+            return o;
+        }
+    };
+
+    template <>
+    struct object_with_zone<paxos::value> {
+        void operator()(object::with_zone& o, const paxos::value& v) const
+        {
+            o.type = type::ARRAY;
+            o.via.array.size = 2;
+            o.via.array.ptr = static_cast<object*>(o.zone.allocate_align(sizeof(object) * 2));
+            o.via.array.ptr[0] = object(v.type(), o.zone);
+            std::visit([&o](const auto& alt) {
+                if constexpr (std::is_same_v<std::decay_t<decltype(alt)>, std::monostate>)
+                {
+                    o.via.array.ptr[1] = object();
+                }
+                else
+                {
+                    o.via.array.ptr[1] = object(alt, o.zone);
+                }
+            }, v.data);
+        }
+    };
+}
+}
+}
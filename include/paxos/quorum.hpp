@@ -0,0 +1,66 @@
+#pragma once
+
+namespace paxos
+{
+    /*
+     * Quorum sizes of the two phases, counting the leader. As in Flexible
+     * Paxos only a phase one and a phase two quorum have to intersect, so
+     * commits can make do with a small phase two quorum as long as leader
+     * changes ask for enough acceptors that q1 + q2 > n. Erasure coded
+     * commits need the intersection to hold k acceptors instead of one,
+     * enough fragments to rebuild what was accepted.
+     *
+     * 0 stands for a majority. Membership changes move n, so the sizes are
+     * worked out per round: phase two is capped at n and phase one grows
+     * as far as the intersections need.
+     */
+    class quorums
+    {
+    public:
+        quorums() = default;
+        quorums(int phase_one, int phase_two, int erasure_k = 1);
+
+        static int majority(int voters);
+
+        int phase_one(int voters) const;
+        int phase_two(int voters, bool coded = false) const;
+
+        // whether the sizes work for that many voters as given, without phase one growing
+        bool fits(int voters) const;
+
+    private:
+        int m_q1 = 0;
+        int m_q2 = 0;
+        int m_k = 1;
+    };
+
+    /*
+     * Tallies the answers of one round against the quorum it needs, so the
+     * round stops waiting once the outcome can't change anymore.
+     */
+    class quorum_tracker
+    {
+    public:
+        quorum_tracker(int needed, int voters) : m_needed(needed), m_voters(voters) {}
+
+        void vote(bool yes)
+        {
+            (yes ? m_yes : m_no)++;
+        }
+
+        int yes() const { return m_yes; }
+
+        bool reached() const { return m_yes >= m_needed; }
+
+        // too many refused or didn't answer for the rest to make up for it
+        bool lost() const { return m_voters - m_no < m_needed; }
+
+        bool settled() const { return reached() || lost(); }
+
+    private:
+        int m_needed;
+        int m_voters;
+        int m_yes = 0;
+        int m_no = 0;
+    };
+}
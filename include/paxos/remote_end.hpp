@@ -5,9 +5,14 @@
 #pragma once
 
 #include <paxos/paxos.hpp>
+#include <paxos/shm.hpp>
 #include <rpc/rpc.h>
 #include <rpc/client.h>
+#include <future>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <type_traits>
 #include <boost/utility/string_view.hpp>
 
 namespace paxos
@@ -30,6 +35,60 @@ class remote_end {
         return std::make_pair(c, c->async_call(std::forward<Args>(args)...));
     }
 
+    // log and snapshot transfers go to the peer's bulk lane on port * 3
+    template <int timeout = 2000, class... Args>
+    auto async_bulk_call(Args&&... args)
+    {
+        std::lock_guard<std::mutex> lk{m_call_prot};
+
+        auto c = std::make_shared<rpc::client>(host, port * 3);
+        c->set_timeout(timeout);
+        return std::make_pair(c, c->async_call(std::forward<Args>(args)...));
+    }
+
+    // set when the peer runs on this machine
+    std::shared_ptr<shm::link> m_link;
+
+    // waits for the reply on a thread of its own, the future gets the result
+    template <class R, int timeout = 400, class... Args>
+    std::future<R> tcp_call(const std::string& method, Args... args)
+    {
+        auto p = std::make_shared<std::promise<R>>();
+        auto res = p->get_future();
+
+        std::thread([this, p, method, args...]() mutable {
+            try {
+                auto [c, fut] = async_call<timeout>(method, args...);
+                if constexpr (std::is_void<R>::value) {
+                    fut.get();
+                    p->set_value();
+                }
+                else {
+                    p->set_value(fut.get().template as<R>());
+                }
+            }
+            catch (std::exception &e) {
+                p->set_exception(std::current_exception());
+            }
+        }).detach();
+
+        return res;
+    }
+
+    // through shared memory while the peer is up there and the call fits, TCP otherwise
+    template <class R, int timeout = 400, class... Args>
+    std::future<R> control_call(const std::string& method, Args... args)
+    {
+        if (m_link)
+        {
+            if (auto fut = m_link->call<R>(std::chrono::milliseconds(timeout), method, args...))
+            {
+                return std::move(*fut);
+            }
+        }
+        return tcp_call<R, timeout>(method, args...);
+    }
+
 public:
     remote_end(boost::string_view host, int port) /*: m_c(std::string(host), port)*/ {
         this->host = std::string(host);
@@ -41,8 +100,16 @@ public:
         }*/
     }
 
+    // what the remote applied so far, -1 if it doesn't take us as the leader
+    std::future<int>
+    heartbeat(int node_id, int period_ms);
+
     std::future<bool>
-    heartbeat(int node_id);
+    pre_vote(int node_id, int last_log);
+
+    // asks the remote to take over as leader now, it has to hold everything up to last_log
+    std::future<bool>
+    timeout_now(int node_id, int last_log);
 
     std::future<paxos::promise>
     prepare(paxos::ballot b);
@@ -53,9 +120,31 @@ public:
     std::future<uint8_t>
     get_leader_id();
 
+    std::future<uint8_t>
+    propose(paxos::value v);
+
+    // at most limit committed entries starting at index
     std::future<std::map<int, log_entry>>
-    get_log_entry(int index);
+    get_log_entry(int index, int limit);
+
+    // the first slot the remote can serve from its log and its last committed one
+    std::future<std::pair<int, int>>
+    get_log_bounds();
+
+    std::future<paxos::snapshot_chunk>
+    get_snapshot(int last_log, uint64_t offset);
+
+    // whatever the remote holds for the slot, its fragment if the slot is coded
+    std::future<log_entry>
+    get_slot(int index);
+
+    // pushes entries the remote is missing, returns what it applied after taking them
+    std::future<int>
+    replicate(int node_id, std::map<int, log_entry> entries);
 
     void inform(paxos::ballot b, paxos::value v);
+
+    // control calls go through the link from now on, bulk transfers stay on TCP
+    void set_link(std::shared_ptr<shm::link> l);
 };
 }
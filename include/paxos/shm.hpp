@@ -0,0 +1,238 @@
+#pragma once
+
+#include <paxos/shm_ring.hpp>
+#include <rpc/msgpack.hpp>
+#include <boost/optional.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace paxos
+{
+namespace shm
+{
+    // whether the host names this machine, nodes there are reached through shared memory
+    bool is_local(const std::string& host);
+
+    // a call over shared memory that failed or timed out
+    struct call_error : std::runtime_error
+    {
+        using std::runtime_error::runtime_error;
+    };
+
+    namespace detail
+    {
+        template <class F>
+        struct signature : signature<decltype(&F::operator())> {};
+
+        template <class C, class R, class... Args>
+        struct signature<R (C::*)(Args...) const>
+        {
+            using result = R;
+            using args = std::tuple<std::decay_t<Args>...>;
+        };
+    }
+
+    /*
+     * The calls a node serves over shared memory, bound like the ones of
+     * an rpc::server, and the workers running them so a slow call never
+     * holds up the ring it came in on.
+     */
+    class dispatcher
+    {
+    public:
+        explicit dispatcher(int workers);
+        ~dispatcher();
+
+        // runs what's queued and joins the workers, nothing posted afterwards runs
+        void stop();
+
+        template <class F>
+        void bind(const std::string& name, F fn);
+
+        using reply_fn = std::function<void(bool ok, const RPCLIB_MSGPACK::sbuffer& result)>;
+
+        /*
+         * Runs the call on a worker. The reply gets the packed result, or
+         * the packed error message if the call threw or isn't bound.
+         */
+        void post(const std::string& method, std::shared_ptr<RPCLIB_MSGPACK::object_handle> msg,
+                  const RPCLIB_MSGPACK::object& args, reply_fn reply);
+
+    private:
+        using handler = std::function<void(const RPCLIB_MSGPACK::object& args, RPCLIB_MSGPACK::sbuffer& out)>;
+        std::unordered_map<std::string, handler> m_handlers;
+
+        std::mutex m_prot;
+        std::condition_variable m_cv;
+        std::deque<std::function<void()>> m_jobs;
+        bool m_stop = false;
+        std::vector<std::thread> m_workers;
+    };
+
+    template <class F>
+    void dispatcher::bind(const std::string& name, F fn)
+    {
+        using sig = detail::signature<F>;
+        m_handlers[name] = [fn](const RPCLIB_MSGPACK::object& args, RPCLIB_MSGPACK::sbuffer& out) {
+            auto a = args.as<typename sig::args>();
+            if constexpr (std::is_void<typename sig::result>::value)
+            {
+                std::apply(fn, std::move(a));
+                RPCLIB_MSGPACK::packer<RPCLIB_MSGPACK::sbuffer>(&out).pack_nil();
+            }
+            else
+            {
+                RPCLIB_MSGPACK::pack(out, std::apply(fn, std::move(a)));
+            }
+        };
+    }
+
+    /*
+     * Both directions between this node and a peer on the same machine,
+     * in a segment named after their ports. Each side writes its requests
+     * and replies to one ring and reads the other's. A side puts its pid
+     * in the segment once it's reading, calls only go this way while that
+     * process is around; the caller sends them over TCP otherwise.
+     *
+     * Requests carry their deadline, so a node reading its ring after a
+     * restart doesn't act on calls their sender gave up on. A reply too big
+     * for one message goes back in parts, the call is never run twice.
+     * Whichever side closes last removes the segment.
+     */
+    class link : public std::enable_shared_from_this<link>
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        link(int self_port, int peer_port, std::shared_ptr<dispatcher> d);
+        ~link();
+
+        link(const link&) = delete;
+        link& operator=(const link&) = delete;
+
+        // the segment the two ports share
+        static std::string name(int port_a, int port_b);
+
+        // whether the peer is alive and reading its end
+        bool up() const;
+
+        /*
+         * Sends the call and returns the future of its result, nothing if
+         * the peer is down or the call doesn't fit in the ring. Nothing ran
+         * on the peer then, the caller is free to send it another way.
+         */
+        template <class R, class... Args>
+        boost::optional<std::future<R>> call(std::chrono::milliseconds timeout, const std::string& method,
+                                             const Args&... args);
+
+        // stops reading, calls in flight fail
+        void close();
+
+    private:
+        struct segment;
+
+        // a reply, or the error it came back with
+        using completion = std::function<void(const RPCLIB_MSGPACK::object* res, const std::string* err)>;
+
+        uint64_t expect(clock::time_point deadline, completion done);
+        void forget(uint64_t id);
+
+        bool send(const RPCLIB_MSGPACK::sbuffer& buf, bool wait_for_room);
+        void read_loop();
+        void serve(std::shared_ptr<RPCLIB_MSGPACK::object_handle> msg);
+        void complete(const RPCLIB_MSGPACK::object& msg);
+        void assemble(const RPCLIB_MSGPACK::object& msg);
+        void expire(clock::time_point now);
+
+        std::string m_name;
+        segment* m_seg = nullptr;
+        int m_side;
+        std::unique_ptr<ring> m_out;
+        std::unique_ptr<ring> m_in;
+        std::shared_ptr<dispatcher> m_dispatch;
+
+        std::mutex m_send_prot;
+
+        struct pending
+        {
+            clock::time_point deadline;
+            completion done;
+            std::string parts; // of a reply sent in pieces, so far
+        };
+        std::mutex m_pending_prot;
+        std::unordered_map<uint64_t, pending> m_pending;
+        uint64_t m_next_id = 0;
+
+        std::atomic<bool> m_running{false};
+        std::thread m_reader;
+    };
+
+    template <class R, class... Args>
+    boost::optional<std::future<R>> link::call(std::chrono::milliseconds timeout, const std::string& method,
+                                               const Args&... args)
+    {
+        if (!up())
+        {
+            return boost::none;
+        }
+
+        auto p = std::make_shared<std::promise<R>>();
+        auto res = p->get_future();
+        auto done = [p](const RPCLIB_MSGPACK::object* obj, const std::string* err) {
+            if (err)
+            {
+                p->set_exception(std::make_exception_ptr(call_error(*err)));
+                return;
+            }
+            try
+            {
+                if constexpr (std::is_void<R>::value)
+                {
+                    p->set_value();
+                }
+                else
+                {
+                    p->set_value(obj->as<R>());
+                }
+            }
+            catch (std::exception&)
+            {
+                p->set_exception(std::current_exception());
+            }
+        };
+
+        auto deadline = clock::now() + timeout;
+        auto id = expect(deadline, std::move(done));
+
+        RPCLIB_MSGPACK::sbuffer buf;
+        RPCLIB_MSGPACK::packer<RPCLIB_MSGPACK::sbuffer> pk(&buf);
+        pk.pack_array(5);
+        pk.pack(0);
+        pk.pack(id);
+        pk.pack(method);
+        // steady_clock is CLOCK_MONOTONIC, the peer reads the same clock
+        pk.pack(int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count()));
+        pk.pack(std::make_tuple(args...));
+
+        if (!send(buf, false))
+        {
+            forget(id);
+            return boost::none;
+        }
+        return res;
+    }
+}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace paxos
+{
+namespace shm
+{
+    /*
+     * Single producer, single consumer byte ring in memory shared between
+     * two processes. Messages are length prefixed and never split, one that
+     * doesn't fit before the end of the buffer leaves a wrap marker and
+     * starts over at the front. The consumer sleeps on a futex once the
+     * ring stays dry for a while.
+     *
+     * All zeroes is an empty ring, so a freshly truncated segment needs no
+     * setup and whoever maps it first doesn't matter.
+     */
+    class ring
+    {
+    public:
+        struct state
+        {
+            alignas(64) std::atomic<uint64_t> head; // bytes ever pushed, the producer's
+            alignas(64) std::atomic<uint64_t> tail; // bytes ever popped, the consumer's
+            alignas(64) std::atomic<uint32_t> bell; // futex word, bumped on every push
+            std::atomic<uint32_t> sleeping;
+        };
+
+        static constexpr size_t capacity = 1 << 20;
+
+        // bigger requests go over TCP and bigger replies in parts, so a single one can't hog the ring
+        static constexpr size_t max_message = capacity / 4;
+
+        ring(state* st, char* data) : m_st(st), m_data(data) {}
+
+        // false if the message is too big or there's no room for it right now
+        bool push(const char* data, size_t size);
+
+        // takes the next message, false if there is none
+        bool pop(std::vector<char>& out);
+
+        bool empty() const;
+
+        // returns once something was pushed or the timeout passed
+        void wait(std::chrono::microseconds timeout);
+
+        // drops everything queued, only for the consumer
+        void skip();
+
+    private:
+        state* m_st;
+        char* m_data;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring counters are shared between processes");
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "the bell is used as a futex");
+}
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace paxos
+{
+    /*
+     * Fixed size object pool. Objects are carved out of large slabs and
+     * recycled through an intrusive free list, so a node based container
+     * does one heap allocation per slab instead of one per element.
+     * Slabs are only returned to the heap when the pool dies. The size of
+     * the objects is set by the first allocation.
+     */
+    class slab_pool
+    {
+    public:
+        explicit slab_pool(std::size_t per_slab) : m_per_slab(per_slab) {}
+
+        slab_pool(const slab_pool&) = delete;
+        slab_pool& operator=(const slab_pool&) = delete;
+
+        void* allocate(std::size_t obj_size)
+        {
+            if (m_obj_size == 0)
+            {
+                m_obj_size = std::max(obj_size, sizeof(free_node));
+            }
+
+            if (m_free)
+            {
+                auto res = m_free;
+                m_free = m_free->next;
+                return res;
+            }
+
+            if (m_slabs.empty() || m_used == m_per_slab)
+            {
+                m_slabs.emplace_back(new char[m_obj_size * m_per_slab]);
+                m_used = 0;
+            }
+
+            return m_slabs.back().get() + m_obj_size * m_used++;
+        }
+
+        void deallocate(void* p)
+        {
+            auto n = static_cast<free_node*>(p);
+            n->next = m_free;
+            m_free = n;
+        }
+
+        // whether objects of the size can come from here, any can before the first allocation
+        bool fits(std::size_t obj_size) const { return m_obj_size == 0 || obj_size <= m_obj_size; }
+        std::size_t slab_count() const { return m_slabs.size(); }
+        std::size_t bytes_reserved() const { return m_slabs.size() * m_obj_size * m_per_slab; }
+
+    private:
+        struct free_node
+        {
+            free_node* next;
+        };
+
+        std::size_t m_obj_size = 0;
+        std::size_t m_per_slab;
+        std::size_t m_used = 0;
+        free_node* m_free = nullptr;
+        std::vector<std::unique_ptr<char[]>> m_slabs;
+    };
+
+    /*
+     * Allocator handing out single objects from a slab_pool. Array
+     * allocations (which node based containers never do) go to the heap.
+     * Copies and rebinds share the pool, so allocators compare equal across
+     * them as the standard asks. The pool is sized by the first type that
+     * allocates from it, std::map's node; a bigger type that comes along
+     * later goes to the heap.
+     */
+    template <class T, std::size_t PerSlab = 4096>
+    class slab_allocator
+    {
+    public:
+        using value_type = T;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+
+        template <class U>
+        struct rebind
+        {
+            using other = slab_allocator<U, PerSlab>;
+        };
+
+        slab_allocator() : m_pool(std::make_shared<slab_pool>(PerSlab)) {}
+
+        template <class U>
+        slab_allocator(const slab_allocator<U, PerSlab>& rhs) : m_pool(rhs.m_pool) {}
+
+        T* allocate(std::size_t n)
+        {
+            if (n != 1 || !fits())
+            {
+                return static_cast<T*>(::operator new(n * sizeof(T)));
+            }
+            return static_cast<T*>(m_pool->allocate(sizeof(T)));
+        }
+
+        void deallocate(T* p, std::size_t n)
+        {
+            if (n != 1 || !fits())
+            {
+                ::operator delete(p);
+                return;
+            }
+            m_pool->deallocate(p);
+        }
+
+        const slab_pool& pool() const { return *m_pool; }
+
+        template <class U>
+        bool operator==(const slab_allocator<U, PerSlab>& rhs) const { return m_pool == rhs.m_pool; }
+        template <class U>
+        bool operator!=(const slab_allocator<U, PerSlab>& rhs) const { return m_pool != rhs.m_pool; }
+
+    private:
+        template <class, std::size_t>
+        friend class slab_allocator;
+
+        bool fits() const { return m_pool->fits(sizeof(T)); }
+
+        std::shared_ptr<slab_pool> m_pool;
+    };
+}
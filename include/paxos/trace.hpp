@@ -0,0 +1,194 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <type_traits>
+
+/*
+ * Hot path protocol tracing. Events are fixed size binary records written
+ * into a per thread lock free ring, a background thread drains the rings to
+ * trace<N>.bin and trace_decode turns that back into text or a Chrome trace
+ * offline.
+ *
+ * Every proposal gets a trace id which travels with its remote calls, so
+ * the spans recorded by different nodes for the same round can be tied
+ * together.
+ *
+ * PAXOS_TRACE_LEVEL picks what gets compiled in:
+ *   0 - nothing
+ *   1 - protocol steps (prepare, accept, decide, apply)
+ *   2 - everything, including heartbeats
+ */
+#ifndef PAXOS_TRACE_LEVEL
+#define PAXOS_TRACE_LEVEL 1
+#endif
+
+#define PAXOS_TRACE(level, ev, ...) \
+    do { \
+        if constexpr ((level) <= PAXOS_TRACE_LEVEL) \
+            ::paxos::trace::record(::paxos::trace::ev, { __VA_ARGS__ }); \
+    } while (false)
+
+#define PAXOS_TRACE_CAT_(a, b) a##b
+#define PAXOS_TRACE_CAT(a, b) PAXOS_TRACE_CAT_(a, b)
+
+// records the begin and the end of the enclosing scope as a span of the current trace
+#define PAXOS_TRACE_SPAN(level, step, slot) \
+    ::paxos::trace::span_t<((level) <= PAXOS_TRACE_LEVEL)> \
+        PAXOS_TRACE_CAT(paxos_trace_span_, __LINE__){ ::paxos::trace::step, (slot) }
+
+namespace paxos
+{
+namespace trace
+{
+    enum event_id : uint16_t
+    {
+        prepare_recv,
+        prepare_promise,
+        prepare_reject,
+        accept_ok,
+        accept_reject,
+        decided,
+        applied,
+        heartbeat_recv,
+        span_begin,
+        span_end,
+        event_count
+    };
+
+    enum span_step : int32_t
+    {
+        propose,
+        phase_one,
+        phase_two,
+        prepare,
+        accept,
+        persist,
+        inform,
+        inform_delay,
+        learn_log,
+        replicate,
+        step_count
+    };
+
+    constexpr const char* steps[step_count] = {
+        "propose", "phase_one", "phase_two", "prepare", "accept", "persist", "inform", "inform_delay", "learn_log",
+        "replicate",
+    };
+
+    struct event_info
+    {
+        const char* name;
+        const char* format; // printf format over the six int arguments
+    };
+
+    constexpr event_info events[event_count] = {
+        { "prepare", "slot=%d bal=<%d, %d>" },
+        { "promise", "slot=%d bal=<%d, %d> accepted type=%d val=(%d, %d)" },
+        { "prepare_reject", "slot=%d bal=<%d, %d>" },
+        { "accept", "slot=%d bal=<%d, %d> type=%d val=(%d, %d)" },
+        { "accept_reject", "slot=%d bal=<%d, %d> type=%d val=(%d, %d)" },
+        { "decided", "slot=%d bal=<%d, %d> type=%d val=(%d, %d)" },
+        { "applied", "slot=%d sold=%d type=%d val=(%d, %d)" },
+        { "heartbeat", "from=%d" },
+        { "begin", "trace=%x step=%d slot=%d" },
+        { "end", "trace=%x step=%d slot=%d" },
+    };
+
+    struct event
+    {
+        uint64_t ts_ns; // system clock, so traces of different nodes line up
+        uint16_t id;
+        uint16_t thread;
+        int32_t args[6];
+    };
+
+    struct file_header
+    {
+        char magic[4] = { 'P', 'X', 'T', 'R' };
+        uint32_t version = 1;
+        int32_t node_id = -1;
+        uint32_t event_size = sizeof(event);
+    };
+
+    struct args
+    {
+        args(std::initializer_list<int32_t> a)
+        {
+            auto it = a.begin();
+            for (int i = 0; i < 6 && it != a.end(); ++i, ++it)
+            {
+                v[i] = *it;
+            }
+        }
+
+        int32_t v[6] = {};
+    };
+
+    /*
+     * Appends an event to the calling thread's ring. Never blocks or
+     * allocates after the first call on a thread; events are dropped (and
+     * counted) if the drain thread falls behind.
+     */
+    void record(event_id id, const args& a);
+
+    // starts draining rings into the given file, call once per process
+    void start(const std::string& path, int node_id);
+
+    // drains what's left and stops the background thread, done at exit too if it wasn't called
+    void stop();
+
+    uint64_t dropped();
+
+    // a fresh trace id, unique across the cluster as long as node ids are below 128
+    int32_t new_id(int node_id);
+
+    // the trace the calling thread works for, 0 if none
+    int32_t current();
+
+    // makes the given trace current for the lifetime of the object
+    class context
+    {
+    public:
+        explicit context(int32_t id);
+        ~context();
+
+        context(const context&) = delete;
+        context& operator=(const context&) = delete;
+
+    private:
+        int32_t m_prev;
+    };
+
+    class span
+    {
+    public:
+        span(span_step step, int32_t slot) : m_step(step), m_slot(slot)
+        {
+            record(span_begin, { current(), m_step, m_slot });
+        }
+
+        ~span()
+        {
+            record(span_end, { current(), m_step, m_slot });
+        }
+
+        span(const span&) = delete;
+        span& operator=(const span&) = delete;
+
+    private:
+        int32_t m_step;
+        int32_t m_slot;
+    };
+
+    struct null_span
+    {
+        null_span(span_step, int32_t) {}
+    };
+
+    template <bool Enabled>
+    using span_t = std::conditional_t<Enabled, span, null_span>;
+}
+}
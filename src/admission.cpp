@@ -0,0 +1,107 @@
+#include <paxos/admission.hpp>
+#include <algorithm>
+#include <cmath>
+
+namespace paxos
+{
+    admission::ticket::~ticket()
+    {
+        if (m_gate)
+        {
+            m_gate->leave(clock::now() - m_began);
+        }
+    }
+
+    boost::optional<admission::ticket> admission::enter(int client_id, std::chrono::milliseconds& retry_after)
+    {
+        using namespace std::chrono;
+        std::unique_lock<std::mutex> lk{m_prot};
+        auto now = clock::now();
+        evict_idle(now);
+
+        auto it = m_buckets.find(client_id);
+        if (it == m_buckets.end())
+        {
+            it = m_buckets.emplace(client_id, bucket{ m_limits.client_burst, now }).first;
+        }
+
+        auto& b = it->second;
+        b.tokens = std::min(m_limits.client_burst,
+                            b.tokens + duration<double>(now - b.last).count() * m_limits.client_rate);
+        b.last = now;
+        if (b.tokens < 1)
+        {
+            ++m_stats.rejected_rate;
+            retry_after = milliseconds(int64_t(std::ceil((1 - b.tokens) / m_limits.client_rate * 1000)));
+            return {};
+        }
+
+        if (m_stats.depth >= m_limits.max_inflight + m_limits.max_queue)
+        {
+            ++m_stats.rejected_overload;
+            retry_after = drain_estimate();
+            return {};
+        }
+
+        b.tokens -= 1;
+        ++m_stats.depth;
+        m_stats.max_depth = std::max(m_stats.max_depth, m_stats.depth);
+
+        auto deadline = now + m_limits.max_wait;
+        if (!m_cv.wait_until(lk, deadline, [this] { return m_stats.inflight < m_limits.max_inflight; }))
+        {
+            // the client would have given up by the time we got to it
+            --m_stats.depth;
+            ++m_stats.timed_out;
+            retry_after = drain_estimate();
+            return {};
+        }
+
+        ++m_stats.inflight;
+        ++m_stats.admitted;
+        return ticket{this};
+    }
+
+    void admission::leave(clock::duration service)
+    {
+        {
+            std::lock_guard<std::mutex> lk{m_prot};
+            --m_stats.inflight;
+            --m_stats.depth;
+
+            auto ms = std::chrono::duration<double, std::milli>(service).count();
+            m_stats.service_ms = m_stats.service_ms == 0 ? ms : 0.9 * m_stats.service_ms + 0.1 * ms;
+        }
+        m_cv.notify_one();
+    }
+
+    void admission::evict_idle(clock::time_point now)
+    {
+        auto refill = std::chrono::duration_cast<clock::duration>(
+                std::chrono::duration<double>(m_limits.client_burst / std::max(m_limits.client_rate, 1e-3)));
+
+        // one pass per refill period keeps the scan off the common path
+        if (now - m_last_evict < refill)
+        {
+            return;
+        }
+        m_last_evict = now;
+
+        for (auto it = m_buckets.begin(); it != m_buckets.end();)
+        {
+            it = now - it->second.last >= refill ? m_buckets.erase(it) : std::next(it);
+        }
+    }
+
+    std::chrono::milliseconds admission::drain_estimate() const
+    {
+        auto ms = m_stats.service_ms * m_stats.depth / std::max(m_limits.max_inflight, 1);
+        return std::chrono::milliseconds(std::max<int64_t>(1, int64_t(ms)));
+    }
+
+    admission::stats admission::get_stats() const
+    {
+        std::lock_guard<std::mutex> lk{m_prot};
+        return m_stats;
+    }
+}
@@ -0,0 +1,187 @@
+#include <paxos/block.hpp>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef PAXOS_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef PAXOS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace paxos
+{
+namespace block
+{
+    namespace
+    {
+        constexpr char block_magic[4] = { 'P', 'X', 'L', 'B' };
+
+        // snapshots and compaction aren't latency critical, but they shouldn't crawl either
+        constexpr int zstd_level = 3;
+
+        struct crc_table
+        {
+            uint32_t t[256];
+
+            crc_table()
+            {
+                for (uint32_t i = 0; i < 256; ++i)
+                {
+                    uint32_t c = i;
+                    for (int k = 0; k < 8; ++k)
+                    {
+                        c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+                    }
+                    t[i] = c;
+                }
+            }
+        };
+    }
+
+    uint32_t crc32c(const char* data, size_t size, uint32_t crc)
+    {
+        static const crc_table table;
+        crc = ~crc;
+        for (size_t i = 0; i < size; ++i)
+        {
+            crc = table.t[(crc ^ uint8_t(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    bool is_block(const char* data, size_t size)
+    {
+        return size >= sizeof block_magic && std::memcmp(data, block_magic, sizeof block_magic) == 0;
+    }
+
+    void encode(codec c, const char* data, size_t size, std::string& out)
+    {
+        if (size > UINT32_MAX)
+        {
+            throw std::length_error("block payload too large");
+        }
+
+        auto at = out.size();
+        auto body = at + header_size;
+        auto used = codec::none;
+        size_t stored = size;
+
+#ifdef PAXOS_HAVE_LZ4
+        if (c == codec::lz4)
+        {
+            auto bound = LZ4_compressBound(int(size));
+            out.resize(body + bound);
+            auto n = LZ4_compress_default(data, &out[body], int(size), bound);
+            if (n > 0 && size_t(n) < size)
+            {
+                used = codec::lz4;
+                stored = size_t(n);
+            }
+        }
+#endif
+#ifdef PAXOS_HAVE_ZSTD
+        if (c == codec::zstd)
+        {
+            auto bound = ZSTD_compressBound(size);
+            out.resize(body + bound);
+            auto n = ZSTD_compress(&out[body], bound, data, size, zstd_level);
+            if (!ZSTD_isError(n) && n < size)
+            {
+                used = codec::zstd;
+                stored = n;
+            }
+        }
+#endif
+
+        out.resize(body + stored);
+        if (used == codec::none && size != 0)
+        {
+            std::memcpy(&out[body], data, size);
+        }
+
+        header h{};
+        std::memcpy(h.magic, block_magic, sizeof block_magic);
+        h.codec = uint8_t(used);
+        h.raw_size = uint32_t(size);
+        h.stored_size = uint32_t(stored);
+        h.crc = crc32c(&out[body], stored, crc32c(reinterpret_cast<const char*>(&h), offsetof(header, crc)));
+        std::memcpy(&out[at], &h, header_size);
+    }
+
+    status parse(const char* data, size_t size, view& v)
+    {
+        if (size < header_size)
+        {
+            return status::short_read;
+        }
+        if (!is_block(data, size))
+        {
+            return status::bad_header;
+        }
+
+        header h;
+        std::memcpy(&h, data, header_size);
+        if (h.stored_size > size - header_size)
+        {
+            return status::short_read;
+        }
+
+        v.c = codec(h.codec);
+        v.stored = data + header_size;
+        v.stored_size = h.stored_size;
+        v.raw_size = h.raw_size;
+        v.total = header_size + h.stored_size;
+
+        auto crc = crc32c(data + header_size, h.stored_size, crc32c(data, offsetof(header, crc)));
+        if (crc != h.crc || h.codec > uint8_t(codec::zstd))
+        {
+            return status::bad_crc;
+        }
+        return status::ok;
+    }
+
+    void decode(const view& v, std::vector<char>& out)
+    {
+        out.resize(v.raw_size);
+        switch (v.c)
+        {
+        case codec::none:
+            if (v.stored_size != v.raw_size)
+            {
+                throw std::runtime_error("bad uncompressed block");
+            }
+            if (v.raw_size != 0)
+            {
+                std::memcpy(out.data(), v.stored, v.raw_size);
+            }
+            return;
+        case codec::lz4:
+#ifdef PAXOS_HAVE_LZ4
+            if (LZ4_decompress_safe(v.stored, out.data(), int(v.stored_size), int(v.raw_size)) != int(v.raw_size))
+            {
+                throw std::runtime_error("bad lz4 block");
+            }
+            return;
+#else
+            throw std::runtime_error("block is lz4 compressed, but lz4 support isn't built in");
+#endif
+        case codec::zstd:
+#ifdef PAXOS_HAVE_ZSTD
+        {
+            auto n = ZSTD_decompress(out.data(), v.raw_size, v.stored, v.stored_size);
+            if (ZSTD_isError(n) || n != v.raw_size)
+            {
+                throw std::runtime_error("bad zstd block");
+            }
+            return;
+        }
+#else
+            throw std::runtime_error("block is zstd compressed, but zstd support isn't built in");
+#endif
+        }
+    }
+}
+}
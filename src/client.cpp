@@ -6,7 +6,13 @@
 #include <rpc/client.h>
 #include <fstream>
 #include <nlohmann/json.hpp>
+#include <paxos/paxos.hpp>
 #include <rpc/rpc_error.h>
+#include <chrono>
+#include <climits>
+#include <random>
+#include <thread>
+#include <tuple>
 
 int main(int argc, char *argv[])
 {
@@ -65,11 +71,34 @@ int main(int argc, char *argv[])
     }
     std::cout << "Connected to " << int(curr_leader_id) << "!\n";
 
+    // an overloaded server turns requests away, wait as long as it asks and retry
+    auto call = [&client](const std::string& func, auto... args) -> uint8_t {
+        for (int attempt = 0; ; ++attempt)
+        {
+            try
+            {
+                return client->call(func, args...).template as<uint8_t>();
+            }
+            catch (rpc::rpc_error& err)
+            {
+                if (attempt == 10) throw;
+                auto [reason, retry_after] = err.get_error().as<std::tuple<std::string, int>>();
+                std::cerr << "Server " << reason << ", retrying in " << retry_after << " ms\n";
+                std::this_thread::sleep_for(std::chrono::milliseconds(retry_after));
+            }
+        }
+    };
+
+    // a retry of the same purchase reuses its request id so it's only decided once
+    std::random_device rd;
+    const int session = std::uniform_int_distribution<int>(1, INT_MAX)(rd);
+    int request = 0;
+
     retry:
     std::cout << "> ";
     for (std::string cmd; std::cin >> cmd; std::cout << "> ") {
         if (cmd == "cc") {
-            auto leader_id = client->call("cc").as<uint8_t>();
+            auto leader_id = call("cc", session);
             while (leader_id != curr_leader_id)
             {
                 if (leader_id == 0xFF)
@@ -80,13 +109,14 @@ int main(int argc, char *argv[])
                 curr_leader_id = leader_id;
                 client = connect(curr_leader_id);
 
-                leader_id = client->call("cc").as<uint8_t>();
+                leader_id = call("cc", session);
             }
             std::cout << "Curr Leader: " << int(curr_leader_id) << std::endl;
         } else if (cmd == "buy") {
             int num;
             std::cin >> num;
-            auto leader_id = client->call("buy", num, node_id).as<uint8_t>();
+            ++request;
+            auto leader_id = call("buy", num, node_id, session, request);
 
             while (leader_id != curr_leader_id)
             {
@@ -98,11 +128,50 @@ int main(int argc, char *argv[])
                 curr_leader_id = leader_id;
                 client = connect(curr_leader_id);
 
-                leader_id = client->call("buy", num, node_id).as<uint8_t>();
+                leader_id = call("buy", num, node_id, session, request);
             }
             std::cout << "Curr Leader: " << int(curr_leader_id) << std::endl;
+        } else if (cmd == "submit") {
+            std::string payload;
+            std::cin >> payload;
+            auto leader_id = call("submit", session, std::vector<char>(payload.begin(), payload.end()));
+            std::cout << "Submitted " << payload.size() << " bytes through " << int(leader_id) << std::endl;
+        } else if (cmd == "promote") {
+            int learner;
+            std::cin >> learner;
+            auto leader_id = call("promote", session, learner);
+            std::cout << "Promoted " << learner << " through " << int(leader_id) << std::endl;
         } else if (cmd == "show") {
-            std::cout << client->call("show").as<std::string>();
+            paxos::summary sum;
+            try
+            {
+                sum = client->call("summary").as<paxos::summary>();
+            }
+            catch (rpc::rpc_error& err)
+            {
+                std::cout << "Node is too far behind the leader to answer, ask another one\n";
+                continue;
+            }
+            std::cout << "##### SHOW #####\n";
+            std::cout << "Current leader: " << sum.leader << '\n';
+            std::cout << "Sold Tickets: " << sum.sold_tickets << '\n';
+            if (sum.learner)
+            {
+                std::cout << "Learner, " << sum.staleness_ms << " ms behind the leader\n";
+            }
+            if (sum.snapshot_base > 0)
+            {
+                std::cout << "Logs up to " << sum.snapshot_base << " are in a snapshot\n";
+            }
+            for (int cursor = 0; cursor != -1;)
+            {
+                auto page = client->call("log_range", cursor, 100).as<paxos::log_page>();
+                for (auto& log : page.entries)
+                {
+                    std::cout << "Log " << log.first << " : " << log.second << '\n';
+                }
+                cursor = page.next;
+            }
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,187 @@
+#include <paxos/erasure.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace paxos
+{
+namespace erasure
+{
+    namespace
+    {
+        // GF(2^8) with the x^8 + x^4 + x^3 + x^2 + 1 polynomial
+        struct tables
+        {
+            uint8_t exp[512];
+            uint8_t log[256] = {};
+
+            tables()
+            {
+                int x = 1;
+                for (int i = 0; i < 255; ++i)
+                {
+                    exp[i] = uint8_t(x);
+                    log[x] = uint8_t(i);
+                    x <<= 1;
+                    if (x & 0x100) x ^= 0x11d;
+                }
+                for (int i = 255; i < 512; ++i)
+                {
+                    exp[i] = exp[i - 255];
+                }
+            }
+        };
+
+        const tables& gf()
+        {
+            static const tables t;
+            return t;
+        }
+
+        uint8_t mul(uint8_t a, uint8_t b)
+        {
+            if (a == 0 || b == 0) return 0;
+            return gf().exp[gf().log[a] + gf().log[b]];
+        }
+
+        uint8_t inv(uint8_t a)
+        {
+            return gf().exp[255 - gf().log[a]];
+        }
+
+        // dst += c * src, one table lookup per byte
+        void mul_add(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len)
+        {
+            if (c == 0) return;
+            uint8_t row[256];
+            for (int i = 0; i < 256; ++i)
+            {
+                row[i] = mul(c, uint8_t(i));
+            }
+            for (size_t i = 0; i < len; ++i)
+            {
+                dst[i] ^= row[src[i]];
+            }
+        }
+
+        // parity rows use k..n-1 and data columns 0..k-1, so no entry divides by zero
+        uint8_t cauchy(int row, int col)
+        {
+            return inv(uint8_t(row ^ col));
+        }
+    }
+
+    size_t fragment_size(size_t size, int k)
+    {
+        return (size + k - 1) / k;
+    }
+
+    std::vector<std::vector<char>> encode(const char* data, size_t size, int k, int n)
+    {
+        if (k < 1 || n < k || n > 256)
+        {
+            throw std::invalid_argument("bad erasure code parameters");
+        }
+
+        auto len = fragment_size(size, k);
+        std::vector<std::vector<char>> res(n, std::vector<char>(len, 0));
+        for (int j = 0; j < k; ++j)
+        {
+            auto begin = std::min(size, j * len);
+            auto end = std::min(size, begin + len);
+            if (end > begin)
+            {
+                std::memcpy(res[j].data(), data + begin, end - begin);
+            }
+        }
+
+        for (int r = k; r < n; ++r)
+        {
+            auto dst = reinterpret_cast<uint8_t*>(res[r].data());
+            for (int j = 0; j < k; ++j)
+            {
+                mul_add(dst, reinterpret_cast<const uint8_t*>(res[j].data()), cauchy(r, j), len);
+            }
+        }
+        return res;
+    }
+
+    std::vector<char> decode(const std::map<int, const char*>& fragments, size_t size, int k, int n)
+    {
+        if (int(fragments.size()) < k)
+        {
+            throw std::runtime_error("not enough fragments to rebuild the value");
+        }
+
+        auto len = fragment_size(size, k);
+        std::vector<char> padded(len * k, 0);
+
+        // the encoding rows of the first k fragments we have
+        std::vector<int> rows;
+        std::vector<const uint8_t*> srcs;
+        for (auto& f : fragments)
+        {
+            if (int(rows.size()) == k) break;
+            if (f.first < 0 || f.first >= n)
+            {
+                throw std::runtime_error("fragment index out of range");
+            }
+            rows.push_back(f.first);
+            srcs.push_back(reinterpret_cast<const uint8_t*>(f.second));
+        }
+
+        std::vector<uint8_t> m(k * k, 0), minv(k * k, 0);
+        for (int i = 0; i < k; ++i)
+        {
+            for (int j = 0; j < k; ++j)
+            {
+                m[i * k + j] = rows[i] < k ? uint8_t(rows[i] == j) : cauchy(rows[i], j);
+            }
+            minv[i * k + i] = 1;
+        }
+
+        // gauss-jordan, any k rows of the code are independent so a pivot always exists
+        for (int c = 0; c < k; ++c)
+        {
+            int p = c;
+            while (m[p * k + c] == 0) ++p;
+            if (p != c)
+            {
+                std::swap_ranges(m.begin() + p * k, m.begin() + p * k + k, m.begin() + c * k);
+                std::swap_ranges(minv.begin() + p * k, minv.begin() + p * k + k, minv.begin() + c * k);
+            }
+
+            auto f = inv(m[c * k + c]);
+            for (int j = 0; j < k; ++j)
+            {
+                m[c * k + j] = mul(m[c * k + j], f);
+                minv[c * k + j] = mul(minv[c * k + j], f);
+            }
+
+            for (int r = 0; r < k; ++r)
+            {
+                auto g = m[r * k + c];
+                if (r == c || g == 0) continue;
+                for (int j = 0; j < k; ++j)
+                {
+                    m[r * k + j] ^= mul(g, m[c * k + j]);
+                    minv[r * k + j] ^= mul(g, minv[c * k + j]);
+                }
+            }
+        }
+
+        for (int j = 0; j < k; ++j)
+        {
+            auto dst = reinterpret_cast<uint8_t*>(padded.data() + j * len);
+            for (int t = 0; t < k; ++t)
+            {
+                mul_add(dst, srcs[t], minv[j * k + t], len);
+            }
+        }
+
+        padded.resize(size);
+        return padded;
+    }
+}
+}
@@ -0,0 +1,93 @@
+#include <paxos/escrow.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace paxos
+{
+    escrow_ledger::escrow_ledger(std::string path) : m_path(std::move(path))
+    {
+        m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (m_fd == -1)
+        {
+            throw std::system_error(errno, std::generic_category(), "can't open " + m_path);
+        }
+
+        int64_t sold = 0;
+        if (::pread(m_fd, &sold, sizeof sold, 0) == sizeof sold)
+        {
+            m_sold = sold;
+            m_durable = sold;
+        }
+    }
+
+    escrow_ledger::~escrow_ledger()
+    {
+        if (m_fd != -1)
+        {
+            ::close(m_fd);
+        }
+    }
+
+    int64_t escrow_ledger::sold() const
+    {
+        std::lock_guard<std::mutex> lk{m_prot};
+        return m_sold;
+    }
+
+    int64_t escrow_ledger::durable() const
+    {
+        std::lock_guard<std::mutex> lk{m_prot};
+        return m_durable;
+    }
+
+    int64_t escrow_ledger::add_sold(int count)
+    {
+        std::lock_guard<std::mutex> lk{m_prot};
+        m_sold += count;
+        return m_sold;
+    }
+
+    void escrow_ledger::wait(int64_t total)
+    {
+        std::unique_lock<std::mutex> lk{m_prot};
+        while (m_durable < total)
+        {
+            if (total <= m_failed)
+            {
+                throw std::system_error(m_error, std::generic_category(), "escrow write");
+            }
+            if (m_syncing)
+            {
+                m_synced_cv.wait(lk);
+                continue;
+            }
+
+            m_syncing = true;
+            auto sold = m_sold;
+            lk.unlock();
+
+            // a single aligned 8 byte write can't be torn
+            int err = 0;
+            if (::pwrite(m_fd, &sold, sizeof sold, 0) != sizeof sold || ::fdatasync(m_fd) != 0)
+            {
+                err = errno != 0 ? errno : EIO;
+            }
+
+            lk.lock();
+            m_syncing = false;
+            if (err == 0)
+            {
+                m_durable = std::max(m_durable, sold);
+            }
+            else
+            {
+                m_failed = sold;
+                m_error = err;
+            }
+            m_synced_cv.notify_all();
+        }
+    }
+}
@@ -3,32 +3,177 @@
 //
 
 #include <paxos/remote_end.hpp>
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 #include <thread>
+#include <utility>
 #include <rpc/rpc_error.h>
 #include <rpc/msgpack.hpp>
 #include <fstream>
 #include <paxos/local_end.hpp>
+#include <paxos/erasure.hpp>
+#include <paxos/trace.hpp>
 #include <rpc/this_handler.h>
 
 namespace paxos
 {
-    local_end::local_end(uint16_t port, int n_id) :
-            m_server(port), m_node_id(n_id), m_last_hb(clock::now())
+    namespace
+    {
+        namespace msgpack = RPCLIB_MSGPACK;
+
+        // a joining node pulls the snapshot in pieces of this size
+        constexpr size_t snapshot_chunk_size = 64 * 1024;
+
+        // nodes further behind than this skip the history and take a snapshot
+        constexpr int snapshot_lag = 256;
+
+        // the most entries a single log_range call returns
+        constexpr int max_page = 1000;
+
+        // a session idle for this many slots is forgotten, its retries run again
+        constexpr int session_expiry = 1 << 16;
+
+        // committed entries per get_log page when catching up
+        constexpr int catch_up_batch = 4096;
+
+        // entries per batch the leader pushes, and the most batches in flight to one follower
+        constexpr int push_batch = 512;
+        constexpr int max_push_window = 8;
+
+        // how long a leadership transfer waits for the successor to catch up before it gives up
+        constexpr auto transfer_catch_up = std::chrono::seconds(2);
+
+        // control lane workers, at least a few so forwarded proposals can't starve the acceptor
+        int control_workers()
+        {
+            return std::max(4, int(std::thread::hardware_concurrency()));
+        }
+
+        // what a value roughly takes on the wire, for the bulk lane's rate cap and sent_bytes
+        size_t wire_size(const paxos::value& v)
+        {
+            if (auto bl = v.bl()) return 32 + bl->size();
+            if (auto fr = v.fr()) return 32 + fr->bytes.size();
+            return 32;
+        }
+
+        size_t wire_size(const log_entry& e)
+        {
+            return wire_size(e.m_val);
+        }
+
+        // our fragment of the same proposal is as good as theirs, and keeps k distinct ones around
+        bool keep_ours(const log_entry& ours, const log_entry& theirs)
+        {
+            return ours.m_val.fr() && theirs.m_val.fr() && ours.m_accept_bal == theirs.m_accept_bal;
+        }
+
+        /*
+         * The value of the highest ballot among the promises that can be
+         * rebuilt: a whole value, or k distinct fragments of it. With fewer
+         * fragments the ballot can't have reached a coded quorum, so the
+         * next one down is looked at.
+         */
+        boost::optional<paxos::value> recover(std::vector<paxos::promise> proms)
+        {
+            auto key = [](const paxos::ballot& b) { return std::make_pair(b.number, b.node_id); };
+            std::sort(proms.begin(), proms.end(), [&](const auto& a, const auto& b) {
+                return key(a.accept_num) > key(b.accept_num);
+            });
+
+            for (auto it = proms.begin(); it != proms.end();)
+            {
+                auto end = std::find_if(it, proms.end(), [&](const auto& p) {
+                    return key(p.accept_num) != key(it->accept_num);
+                });
+
+                // nothing was accepted by the rest
+                if (it->accept_num.node_id == -1) break;
+
+                std::map<int, const char*> frags;
+                const paxos::fragment* any = nullptr;
+                for (auto p = it; p != end; ++p)
+                {
+                    auto fr = p->accept_val.fr();
+                    if (!fr)
+                    {
+                        return p->accept_val;
+                    }
+                    if (fr->bytes.size() == erasure::fragment_size(fr->size, fr->k))
+                    {
+                        frags.emplace(fr->index, fr->bytes.data());
+                        any = fr;
+                    }
+                }
+
+                if (any && int(frags.size()) >= any->k)
+                {
+                    return paxos::value{ paxos::blob(erasure::decode(frags, any->size, any->k, any->n)) };
+                }
+                it = end;
+            }
+            return {};
+        }
+
+        // the two payload fields of a value, for tracing
+        std::pair<int, int> payload(const paxos::value& v)
+        {
+            if (auto ts = v.ts()) return { ts->client_id, ts->ticket_count };
+            if (auto cc = v.cc()) return { cc->new_node1, cc->new_node2 };
+            if (auto qt = v.qt()) return { qt->node_id, qt->delta };
+            if (auto pr = v.pr()) return { pr->node_id, 0 };
+            if (auto bl = v.bl()) return { int(bl->size()), 0 };
+            if (auto fr = v.fr()) return { int(fr->size), fr->index };
+            return { 0, 0 };
+        }
+    }
+
+    template <class F>
+    void local_end::bind_control(const std::string& name, F fn) {
+        m_server.bind(name, fn);
+        m_shm->bind(name, fn);
+    }
+
+    local_end::local_end(uint16_t port, int n_id, bool learner) :
+            m_last_hb(clock::now()), m_server(port), m_port(port), m_shm(std::make_shared<shm::dispatcher>(control_workers())),
+            m_bulk_server(port * 3), m_learner(learner), m_store("log" + std::to_string(n_id) + ".mpk"), m_node_id(n_id)
     {
         m_l = spdlog::stderr_color_mt("le_log" + std::to_string(n_id));
-        m_server.bind("heartbeat", [this](int node)
+        m_running = true;
+        m_rng.seed(std::random_device{}() ^ uint32_t(n_id));
+
+        bind_control("heartbeat", [this](int node, int period_ms)
         {
-            //std::cout << "Got heartbeat from " << node << "\n";
+            PAXOS_TRACE(2, heartbeat_recv, node);
+            if (node != m_curr_leader && [this] { std::shared_lock<std::shared_mutex> lk{m_log_prot}; return !voter(); }())
+            {
+                // learners never see accepts, heartbeats are how they find a new leader
+                m_curr_leader = node;
+            }
             if (node == m_curr_leader)
             {
                 m_last_hb = clock::now();
-                return true;
+                m_hb_period_ms = period_ms;
+
+                // the leader tracks our progress through this
+                std::shared_lock<std::shared_mutex> lk{m_log_prot};
+                return m_state.last_log;
             }
-            return false;
+            return -1;
+        });
+
+        bind_control("pre_vote", [this](int node, int last_log)
+        {
+            if (am_i_leader() || get_leader())
+            {
+                return false;
+            }
+            return last_log >= get_last_log();
         });
 
-        m_server.bind("prepare", [this](paxos::ballot bal) {
+        bind_control("prepare", [this](paxos::ballot bal, int32_t trace_id) {
+            trace::context ctx{trace_id};
             if (bal.node_id == m_curr_leader)
             {
                 m_last_hb = clock::now();
@@ -36,7 +181,8 @@ namespace paxos
             return prepare(bal);
         });
 
-        m_server.bind("accept", [this](paxos::ballot bal, paxos::value val){
+        bind_control("accept", [this](paxos::ballot bal, paxos::value val, int32_t trace_id){
+            trace::context ctx{trace_id};
             if (bal.node_id == m_curr_leader)
             {
                 m_last_hb = clock::now();
@@ -44,7 +190,8 @@ namespace paxos
             return accept(bal, val);
         });
 
-        m_server.bind("inform", [this](paxos::ballot b, paxos::value v) {
+        bind_control("inform", [this](paxos::ballot b, paxos::value v, int32_t trace_id) {
+            trace::context ctx{trace_id};
             if (b.node_id == m_curr_leader)
             {
                 m_last_hb = clock::now();
@@ -52,97 +199,682 @@ namespace paxos
             return inform(b, v);
         });
 
-        m_server.bind("get_leader", [this] {
+        bind_control("timeout_now", [this](int from, int last_log) {
+            return take_over(uint8_t(from), last_log);
+        });
+
+        bind_control("get_leader", [this] {
             return get_leader_id();
         });
 
-        m_server.bind("get_log", [this](int index) {
-            auto it = m_log.lower_bound(index);
-            std::map<int, log_entry> res;
-            for (; it != m_log.end(); ++it)
+        bind_control("propose", [this](paxos::value v, int32_t trace_id) {
+            trace::context ctx{trace_id};
+            return propose(v, true);
+        });
+
+        m_bulk_server.bind("get_log", [this](int index, int limit, int32_t trace_id) {
+            trace::context ctx{trace_id};
+            auto res = get_committed(index, std::clamp(limit, 1, catch_up_batch));
+            size_t bytes = 0;
+            for (auto& e : res)
             {
-                if (it->second.m_commited)
+                bytes += wire_size(e.second);
+            }
+            bulk_throttle(bytes);
+            return res;
+        });
+
+        m_bulk_server.bind("log_bounds", [this] {
+            int base;
+            {
+                std::shared_lock<std::shared_mutex> lk{m_log_prot};
+                base = m_snap_base;
+            }
+            return std::make_pair(base, get_last_log());
+        });
+
+        m_bulk_server.bind("get_snapshot", [this](int last_log, uint64_t offset) {
+            auto res = get_snapshot(last_log, offset);
+            bulk_throttle(res.data.size());
+            return res;
+        });
+
+        m_bulk_server.bind("get_slot", [this](int index) {
+            log_entry res;
+            {
+                std::shared_lock<std::shared_mutex> lk{m_log_prot};
+                auto it = m_log.find(index);
+                if (it != m_log.end())
+                {
+                    std::lock_guard<std::mutex> slot_lk{stripe(index)};
+                    res = it->second;
+                }
+                else if (m_store.contains(index))
                 {
-                    res.insert(*it);
+                    res = m_store.read(index);
                 }
             }
+            bulk_throttle(wire_size(res));
             return res;
         });
 
-        m_server.suppress_exceptions(true);
-        m_server.async_run(1);
+        m_bulk_server.bind("replicate", [this](int node, std::map<int, log_entry> entries, int32_t trace_id) {
+            trace::context ctx{trace_id};
+            return receive_push(node, entries);
+        });
 
         m_state.m_node_id = m_node_id;
 
         load_log();
+
+        m_catch_up_thread = std::thread([this] {
+            std::unique_lock<std::mutex> lk{m_catch_up_prot};
+            while (true)
+            {
+                m_catch_up_cv.wait(lk, [this] { return m_catch_up_pending || !m_running; });
+                if (!m_running) break;
+                lk.unlock();
+
+                {
+                    // decisions arriving meanwhile are covered by the same fetch
+                    PAXOS_TRACE_SPAN(1, inform_delay, -1);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+
+                lk.lock();
+                m_catch_up_pending = false;
+                lk.unlock();
+
+                try
+                {
+                    learn_log();
+                }
+                catch (std::exception& err)
+                {
+                    m_l->info("Catching up failed: {}", err.what());
+                }
+                lk.lock();
+            }
+        });
+
+        m_repl_thread = std::thread([this] {
+            while (m_running)
+            {
+                auto busy = replicate();
+                std::unique_lock<std::mutex> lk{m_repl_prot};
+                // acks are polled, so look again soon while batches are out
+                m_repl_cv.wait_for(lk, busy ? clock::duration(std::chrono::milliseconds(2)) : hb_period());
+            }
+        });
+
+        m_server.suppress_exceptions(true);
+        // forwarded proposals block their worker for a whole consensus round,
+        // and acceptor requests for different slots run and group commit side by side
+        m_server.async_run(control_workers());
+
+        // transfers never take a control worker, however big they get
+        m_bulk_server.suppress_exceptions(true);
+        m_bulk_server.async_run(2);
+    }
+
+    void local_end::set_erasure(int k, size_t min_size) {
+        m_erasure_k = std::max(k, 1);
+        m_erasure_min = min_size;
+    }
+
+    void local_end::set_quorums(int phase_one, int phase_two) {
+        m_phase_one_quorum = phase_one;
+        m_phase_two_quorum = phase_two;
+    }
+
+    paxos::quorums local_end::quorum_sizes() const {
+        return { m_phase_one_quorum, m_phase_two_quorum, m_erasure_k };
+    }
+
+    boost::optional<paxos::blob> local_end::rebuild(int index, const paxos::fragment& mine) {
+        std::vector<std::future<log_entry>> futs;
+        for (auto& remote : get_config(index))
+        {
+            futs.push_back(m_conns_[remote]->get_slot(index));
+        }
+
+        std::map<int, paxos::blob> have{ { mine.index, mine.bytes } };
+        boost::optional<paxos::blob> whole;
+        for (auto& fut : futs)
+        {
+            if (whole || int(have.size()) >= mine.k) break;
+            try
+            {
+                auto e = fut.get();
+                if (!e.m_commited) continue;
+                if (auto bl = e.m_val.bl(); bl && bl->size() == mine.size)
+                {
+                    whole = *bl;
+                }
+                else if (auto fr = e.m_val.fr(); fr && fr->k == mine.k && fr->n == mine.n && fr->size == mine.size &&
+                                                 fr->bytes.size() == mine.bytes.size())
+                {
+                    have.emplace(fr->index, fr->bytes);
+                }
+            }
+            catch (std::exception&)
+            {
+            }
+        }
+
+        if (!whole && int(have.size()) >= mine.k)
+        {
+            std::map<int, const char*> frags;
+            for (auto& f : have)
+            {
+                frags.emplace(f.first, f.second.data());
+            }
+            whole = paxos::blob(erasure::decode(frags, mine.size, mine.k, mine.n));
+        }
+
+        if (whole)
+        {
+            // rebuilt once, later reads get it from the log
+            std::unique_lock<std::shared_mutex> lk{m_log_prot};
+            auto& slot = entry(index);
+            if (slot.m_commited && slot.m_val.fr())
+            {
+                slot.m_val = paxos::value{ *whole };
+                auto seq = dump_log(index);
+                lk.unlock();
+                m_store.wait(seq);
+            }
+        }
+        return whole;
+    }
+
+    void local_end::set_bulk_rate(int64_t bytes_per_sec) {
+        m_bulk_rate = bytes_per_sec;
     }
 
-    void local_end::show(std::ostream &to) {
-        to << "##### SHOW #####\n";
-        to << "Current leader: " << int(get_leader_id()) << '\n';
-        to << "Sold Tickets: " << m_state.sold_tickets << '\n';
-        for (auto& log : m_log)
+    void local_end::bulk_throttle(size_t bytes) {
+        auto rate = double(m_bulk_rate.load());
+        if (rate <= 0)
         {
-            if (!log.second.m_commited) continue;
+            return;
+        }
+
+        std::unique_lock<std::mutex> lk{m_bulk_prot};
+        auto now = clock::now();
+        m_bulk_tokens = std::min(rate, m_bulk_tokens + rate * std::chrono::duration<double>(now - m_bulk_refill).count());
+        m_bulk_refill = now;
 
-            to << "Log " << log.first << " : ";
-            if (log.second.m_val.type == 0)
+        // the reply goes out after paying off its debt, the next one pays for its own
+        m_bulk_tokens -= double(bytes);
+        if (m_bulk_tokens < 0)
+        {
+            auto wait = std::chrono::duration<double>(-m_bulk_tokens / rate);
+            lk.unlock();
+            std::this_thread::sleep_for(wait);
+        }
+    }
+
+    void local_end::request_catch_up() {
+        {
+            std::lock_guard<std::mutex> lk{m_catch_up_prot};
+            m_catch_up_pending = true;
+        }
+        m_catch_up_cv.notify_one();
+    }
+
+    void local_end::note_progress(uint8_t node, int applied, int owed) {
+        bool behind;
+        {
+            std::lock_guard<std::mutex> lk{m_repl_prot};
+            auto& p = m_progress[node];
+            p.match = std::max(p.match, applied);
+            p.owed = std::max(p.owed, owed);
+            behind = p.match < p.owed;
+        }
+        if (behind)
+        {
+            m_repl_cv.notify_one();
+        }
+    }
+
+    bool local_end::replicate() {
+        if (!am_i_leader())
+        {
+            // a new term starts with no idea where anyone is
+            std::lock_guard<std::mutex> lk{m_repl_prot};
+            m_progress.clear();
+            return false;
+        }
+
+        int end;
+        {
+            std::shared_lock<std::shared_mutex> lk{m_log_prot};
+            end = std::max(m_store.end_index(), m_log.empty() ? 0 : m_log.rbegin()->first + 1);
+        }
+
+        auto targets = get_config(end);
+        auto rest = learners(end);
+        targets.insert(targets.end(), rest.begin(), rest.end());
+
+        bool busy = false;
+        for (auto remote : targets)
+        {
+            std::vector<std::map<int, log_entry>> batches;
             {
-                to << log.second.m_val.ts;
-            } else {
-                to << log.second.m_val.cc;
+                std::lock_guard<std::mutex> lk{m_repl_prot};
+                auto& p = m_progress[remote];
+                auto now = clock::now();
+
+                // acks come back in order, the first pending one blocks the rest
+                while (!p.inflight.empty() && p.inflight.front().ack.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+                {
+                    auto b = std::move(p.inflight.front());
+                    p.inflight.pop_front();
+                    try
+                    {
+                        auto applied = b.ack.get();
+                        if (applied < 0)
+                        {
+                            throw std::runtime_error("not following us");
+                        }
+                        p.match = std::max(p.match, applied);
+                        if (applied < b.first - 1)
+                        {
+                            // it lacks slots before the batch, resend from there
+                            p.next = applied + 1;
+                            p.inflight.clear();
+                            p.window = 1;
+                            p.retry_at = now + hb_period();
+                        }
+                        else
+                        {
+                            p.window = std::min(p.window + 1, max_push_window);
+                        }
+                    }
+                    catch (std::exception&)
+                    {
+                        // slow or gone, go back to a batch at a time
+                        p.next = p.match + 1;
+                        p.inflight.clear();
+                        p.window = 1;
+                        p.retry_at = now + hb_period();
+                    }
+                }
+
+                // nothing out and still behind, whatever went past match was lost
+                if (p.inflight.empty() && (p.next <= p.match || p.match < p.owed))
+                {
+                    p.next = p.match + 1;
+                }
+
+                // followers that were up to date at their last report are left alone
+                while (p.match < p.owed && now >= p.retry_at && p.next < end &&
+                       int(p.inflight.size() + batches.size()) < p.window)
+                {
+                    auto batch = get_committed(p.next, push_batch, true);
+                    if (batch.empty()) break;
+                    p.next = batch.rbegin()->first + 1;
+                    batches.push_back(std::move(batch));
+                }
             }
-            to << '\n';
+
+            for (auto& batch : batches)
+            {
+                size_t bytes = 0;
+                for (auto& e : batch)
+                {
+                    bytes += wire_size(e.second);
+                }
+                bulk_throttle(bytes);
+
+                auto first = batch.begin()->first;
+                auto ack = m_conns_[remote]->replicate(m_node_id, std::move(batch));
+                std::lock_guard<std::mutex> lk{m_repl_prot};
+                m_progress[remote].inflight.push_back({ first, std::move(ack) });
+            }
+
+            std::lock_guard<std::mutex> lk{m_repl_prot};
+            busy = busy || !m_progress[remote].inflight.empty();
+        }
+        return busy;
+    }
+
+    int local_end::receive_push(uint8_t from, const std::map<int, log_entry>& entries) {
+        PAXOS_TRACE_SPAN(1, replicate, entries.empty() ? -1 : entries.begin()->first);
+        if (from != m_curr_leader)
+        {
+            return -1;
+        }
+
+        uint64_t seq = 0;
+        int applied;
+        std::vector<std::pair<paxos::ballot, paxos::value>> accepted;
+        {
+            std::lock_guard<std::shared_mutex> lk{m_log_prot};
+            for (auto& l : entries)
+            {
+                auto& slot = entry(l.first);
+                if (slot.m_commited) continue;
+                if (l.second.m_commited)
+                {
+                    if (keep_ours(slot, l.second))
+                    {
+                        slot.m_commited = true;
+                    }
+                    else
+                    {
+                        slot = l.second;
+                    }
+                    seq = dump_log(l.first);
+                }
+                else
+                {
+                    accepted.emplace_back(l.second.accept_bal(l.first), l.second.m_val);
+                }
+            }
+            apply_committed();
+            applied = m_state.last_log;
+        }
+        m_store.wait(seq);
+
+        // the leader's phase two message again, voted on like the first time
+        for (auto& a : accepted)
+        {
+            accept(a.first, a.second);
+        }
+
+        if (!entries.empty() && applied < entries.begin()->first - 1)
+        {
+            // the leader can't push what it folded into its snapshot
+            request_catch_up();
         }
+        return applied;
+    }
+
+    void local_end::apply_committed() {
+        for (auto it = m_log.upper_bound(m_state.last_log); it != m_log.end(); ++it)
+        {
+            if (it->first != m_state.last_log + 1 || !it->second.m_commited) break;
+            m_state.apply(it->first, it->second.m_val);
+        }
+    }
+
+    void local_end::set_durability(log_store::durability mode, std::chrono::microseconds window) {
+        m_store.set_durability(mode, window);
+    }
+
+    void local_end::set_escrow(int grant) {
+        std::lock_guard<std::mutex> lk{m_escrow_prot};
+        if (grant > 0 && !m_ledger)
+        {
+            m_ledger = std::make_unique<escrow_ledger>("escrow" + std::to_string(m_node_id) + ".bin");
+            m_refill_thread = std::thread([this] { refill_loop(); });
+        }
+        m_escrow_grant = grant;
+    }
+
+    local_end::state::escrow local_end::own_escrow() const {
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        return m_state.escrow_of(m_node_id);
+    }
+
+    int local_end::quota_left(const state::escrow &e) const {
+        return e.granted - std::max(e.returned, m_return_requested) - int(m_ledger->sold());
+    }
+
+    bool local_end::sell_local(int count) {
+        std::unique_lock<std::mutex> lk{m_escrow_prot};
+        if (!m_ledger || m_escrow_grant == 0)
+        {
+            return false;
+        }
+
+        auto left = quota_left(own_escrow());
+        if (left < count)
+        {
+            // the refill didn't keep up, wait for a round that knows about this sale
+            m_refill_short = std::max(m_refill_short, count);
+            m_refill_wanted = true;
+            auto round = m_refills + (m_refilling ? 2 : 1);
+            m_refill_cv.notify_all();
+            m_refill_cv.wait(lk, [&] { return m_refills >= round || !m_running; });
+
+            left = quota_left(own_escrow());
+            if (left < count)
+            {
+                return false;
+            }
+        }
+
+        auto total = m_ledger->add_sold(count);
+        if (left - count < m_escrow_grant / 2 && !m_refill_dry && !m_refilling)
+        {
+            // top it up while there's still some to sell from
+            m_refill_wanted = true;
+            m_refill_cv.notify_all();
+        }
+        lk.unlock();
+
+        // other sales made meanwhile share the sync
+        m_ledger->wait(total);
+        return true;
+    }
+
+    void local_end::refill_loop() {
+        std::unique_lock<std::mutex> lk{m_escrow_prot};
+        while (true)
+        {
+            m_refill_cv.wait(lk, [this] { return m_refill_wanted || !m_running; });
+            if (!m_running) break;
+            m_refill_wanted = false;
+            m_refilling = true;
+            auto short_by = std::exchange(m_refill_short, 0);
+            auto granted = own_escrow().granted;
+            auto ask = std::max(m_escrow_grant.load(), short_by);
+            lk.unlock();
+
+            try
+            {
+                // ask for more and report what was sold so far
+                propose(paxos::value{ paxos::quota{ m_node_id, ask, int(m_ledger->durable()) } });
+                learn_log();
+            }
+            catch (std::exception& err)
+            {
+                m_l->info("Couldn't learn the quota grant: {}", err.what());
+            }
+
+            lk.lock();
+            auto e = own_escrow();
+            m_refill_dry = e.granted == granted;
+            auto left = quota_left(e);
+            if (short_by > 0 && left > 0 && left < short_by)
+            {
+                // the pool is dry, the rest of ours is worth more back in it
+                auto before = m_return_requested;
+                m_return_requested = std::max(e.returned, before) + left;
+                lk.unlock();
+                try
+                {
+                    propose(paxos::value{ paxos::quota{ m_node_id, -left, int(m_ledger->durable()) } });
+                    learn_log();
+                }
+                catch (std::exception& err)
+                {
+                    m_l->info("Couldn't learn the quota return: {}", err.what());
+                }
+                lk.lock();
+
+                // the return didn't make it into the log, the tickets are ours to sell again
+                if (own_escrow().returned < m_return_requested)
+                {
+                    m_return_requested = before;
+                }
+            }
+
+            m_refilling = false;
+            ++m_refills;
+            m_refill_cv.notify_all();
+        }
+    }
+
+    std::vector<uint8_t> local_end::get_config(int for_log) const {
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        return m_state.get_config(for_log);
+    }
+
+    paxos::summary local_end::summary() {
+        paxos::summary res;
+        res.node_id = m_node_id;
+        res.leader = get_leader_id();
+
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        res.sold_tickets = m_state.sold_tickets;
+        res.applied = m_state.last_log;
+        res.snapshot_base = m_snap_base;
+        res.log_end = std::max(m_store.end_index(), m_log.empty() ? 0 : m_log.rbegin()->first + 1);
+        res.deduplicated = m_deduplicated;
+        res.escrowed = m_state.escrowed();
+        res.learner = !voter();
+        res.staleness_ms = int(staleness().count());
+        res.sent_bytes = m_sent_bytes;
+        return res;
+    }
+
+    paxos::log_page local_end::log_range(int cursor, int limit) {
+        limit = std::clamp(limit, 1, max_page);
+
+        paxos::log_page res;
+
+        // slots only on disk are decoded after the lock is let go, a big page doesn't hold up consensus
+        std::vector<int> on_disk;
+        std::vector<std::pair<int, paxos::value>> in_memory;
+        int i, end;
+        {
+            std::shared_lock<std::shared_mutex> lk{m_log_prot};
+            end = std::max(m_store.end_index(), m_log.empty() ? 0 : m_log.rbegin()->first + 1);
+
+            // undecided slots are skipped, but still count against the work done for one page
+            i = std::max(cursor, m_snap_base + 1);
+            for (int budget = 4 * limit; i < end && int(in_memory.size() + on_disk.size()) < limit && budget > 0; ++i, --budget)
+            {
+                auto it = m_log.find(i);
+                if (it != m_log.end())
+                {
+                    std::lock_guard<std::mutex> slot_lk{stripe(i)};
+                    if (it->second.m_commited)
+                    {
+                        in_memory.emplace_back(i, it->second.m_val);
+                    }
+                }
+                else if (m_store.contains(i))
+                {
+                    on_disk.push_back(i);
+                }
+            }
+        }
+
+        // the recovered part of the store never changes, it's safe to read unlocked
+        auto mem = in_memory.begin();
+        for (auto index : on_disk)
+        {
+            for (; mem != in_memory.end() && mem->first < index; ++mem)
+            {
+                res.entries.push_back(std::move(*mem));
+            }
+            auto e = m_store.read(index);
+            if (e.m_commited)
+            {
+                res.entries.emplace_back(index, std::move(e.m_val));
+            }
+        }
+        std::move(mem, in_memory.end(), std::back_inserter(res.entries));
+
+        res.next = i < end ? i : -1;
+
+        // we only hold a piece of coded commands, the others have the rest
+        for (auto& e : res.entries)
+        {
+            if (auto fr = e.second.fr())
+            {
+                if (auto whole = rebuild(e.first, *fr))
+                {
+                    e.second = paxos::value{ *whole };
+                }
+            }
+        }
+        return res;
     }
 
     boost::optional<std::pair<ballot, value>> local_end::phase_one(const paxos::value &val, int log_index) {
+        PAXOS_TRACE_SPAN(1, phase_one, log_index);
         using namespace paxos;
         using namespace std;
         vector<future<paxos::promise>> futs;
 
-        if (m_log[log_index].m_commited)
+        paxos::ballot cur_bal;
+        vector<paxos::promise> proms;
         {
-            return {};
-        }
+            std::lock_guard<std::shared_mutex> lk{m_log_prot};
+            auto& slot = entry(log_index);
+            if (slot.m_commited)
+            {
+                return {};
+            }
 
-        m_log[log_index].m_cur_bal.number++;
-        m_log[log_index].m_cur_bal.node_id = m_node_id;
-        m_log[log_index].m_cur_bal.log_index = log_index;
+            cur_bal = slot.cur_bal(log_index);
+            cur_bal.number++;
+            cur_bal.node_id = m_node_id;
+            slot.m_cur_bal = cur_bal.pack();
 
-        auto config = m_state.get_config(log_index);
+            // we're one of the acceptors, what we accepted counts like anyone else's
+            proms.push_back({ cur_bal, slot.accept_bal(log_index), slot.m_val, true });
+        }
+
+        auto config = get_config(log_index);
         for (auto& remote : config)
         {
-            futs.emplace_back(m_conns_[remote]->prepare(m_log[log_index].m_cur_bal));
+            futs.emplace_back(m_conns_[remote]->prepare(cur_bal));
         }
 
-        vector<paxos::promise> proms;
+        // big enough to meet every phase two quorum, in k acceptors if it was coded
+        auto voters = int(config.size()) + 1;
+        quorum_tracker tally(quorum_sizes().phase_one(voters), voters);
+        tally.vote(true);
 
         for (auto& fut : futs)
         {
+            if (tally.settled()) break;
             try
             {
                 auto p = fut.get();
-                if (p.valid)
+                auto valid = p.valid;
+                if (valid)
                 {
                     proms.emplace_back(std::move(p));
-                } else{
+                } else if (p.accept_val.fr()) {
+                    // a lone fragment may never have been chosen and can't be decoded, recovery
+                    // only rebuilds a value out of k fragments of one ballot
+                    proms.emplace_back(std::move(p));
+                } else if (p.accept_val != paxos::value{}) {
                     accept(p.accept_num, p.accept_val);
                     inform(p.accept_num, p.accept_val);
                     return {};
                 }
+                tally.vote(valid);
             }
-            catch (rpc::timeout& err)
+            catch (std::exception& err)
             {
                 cerr << err.what() << '\n';
-                // swallow timeouts
+                tally.vote(false);
+                // swallow timeouts, and the errors of calls over shared memory
             }
         }
 
-        if (proms.size() >= config.size() / 2)
+        if (tally.reached())
         {
             bool all_null_val = std::all_of(proms.begin(), proms.end(), [](const auto& prom){
-                return prom.accept_val != paxos::value{};
+                return prom.accept_val == paxos::value{};
             });
 
             paxos::value v = {};
@@ -152,92 +884,450 @@ namespace paxos
             }
             else
             {
-                paxos::promise max_prom = proms[0];
-                for (auto& prom : proms)
-                {
-                    if (prom.accept_num > max_prom.accept_num)
-                    {
-                        max_prom = prom;
-                    }
-                }
-                v = max_prom.accept_val;
+                auto prev = recover(proms);
+                v = prev ? *prev : val;
             }
 
             // done
-            return std::make_pair(m_log[log_index].m_cur_bal, v);
+            return std::make_pair(cur_bal, v);
         }
 
         return {};
     }
 
     bool local_end::phase_two(const std::pair<paxos::ballot, paxos::value> &p1res) {
+        PAXOS_TRACE_SPAN(1, phase_two, p1res.first.log_index);
         using namespace std;
         vector<future<bool>> futs;
 
-        auto config = m_state.get_config(p1res.first.log_index);
+        auto slot = p1res.first.log_index;
+        auto config = get_config(slot);
+        auto members = [this, slot] {
+            std::shared_lock<std::shared_mutex> lk{m_log_prot};
+            return m_state.members(slot);
+        }();
+
+        // big commands go out as one fragment per acceptor instead of a copy each
+        std::vector<paxos::value> pieces;
+        auto n = int(members.size());
+        auto k = m_erasure_k.load();
+        auto bl = p1res.second.bl();
+        if (k > 1 && k < n && bl && bl->size() >= m_erasure_min)
+        {
+            auto frags = erasure::encode(bl->data(), bl->size(), k, n);
+            for (int i = 0; i < n; ++i)
+            {
+                pieces.emplace_back(paxos::fragment{ i, k, n, uint32_t(bl->size()), paxos::blob(std::move(frags[i])) });
+            }
+        }
+
+        auto piece_for = [&](uint8_t node) -> const paxos::value& {
+            if (pieces.empty()) return p1res.second;
+            auto at = std::find(members.begin(), members.end(), node) - members.begin();
+            return pieces[std::min<size_t>(at, pieces.size() - 1)];
+        };
+
         for (auto& remote : config)
         {
-            futs.emplace_back(m_conns_[remote]->accept(p1res.first, p1res.second));
+            auto& piece = piece_for(remote);
+            m_sent_bytes += wire_size(piece);
+            futs.emplace_back(m_conns_[remote]->accept(p1res.first, piece));
         }
 
-        vector<bool> results;
+        // the leader keeps the whole value, and persists it while the others do the same
+        quorum_tracker tally(quorum_sizes().phase_two(n, !pieces.empty()), n);
+        tally.vote(accept(p1res.first, p1res.second));
 
+        // acceptors that are slow to answer don't hold up the commit once enough of them did
         for (auto& fut : futs)
         {
+            if (tally.settled()) break;
             try
             {
-                auto p = fut.get();
-                results.emplace_back(p);
+                tally.vote(fut.get());
             }
-            catch (rpc::timeout& err)
+            catch (std::exception& err)
             {
                 cerr << err.what() << '\n';
-                results.emplace_back(false);
+                tally.vote(false);
                 // swallow timeouts
             }
         }
-        results.emplace_back(accept(p1res.first, p1res.second));
 
-        int count = std::count(results.begin(), results.end(), true);
+        if (tally.reached())
+        {
+            // decide
+            for (auto& remote : config)
+            {
+                auto& piece = piece_for(remote);
+                m_sent_bytes += wire_size(piece);
+                m_conns_[remote]->inform(p1res.first, piece);
+            }
+            // learners get the piece nobody else holds, and rebuild from the acceptors
+            for (auto& remote : learners(slot))
+            {
+                auto& piece = piece_for(m_node_id);
+                m_sent_bytes += wire_size(piece);
+                m_conns_[remote]->inform(p1res.first, piece);
+            }
+            inform(p1res.first, p1res.second);
+            m_curr_leader = m_node_id;
+            m_last_hb = clock::now();
+            start_hb_thread();
+            return true;
+        }
+        return false;
+    }
+
+    uint8_t local_end::propose(const paxos::value &val, bool forwarded) {
+        // a forwarded proposal carries on with the trace of the node it came from
+        trace::context ctx{trace::current() != 0 ? trace::current() : trace::new_id(m_node_id)};
+        PAXOS_TRACE_SPAN(1, propose, -1);
+
+        // any node that has seen the request decided can answer the retry
+        if (auto at = find_decided(val))
+        {
+            m_l->info("Request already decided in {}", *at);
+            ++m_deduplicated;
+            return m_node_id;
+        }
+
+        uint8_t leader_id = m_curr_leader;
+        auto leader = get_leader();
+        if (forwarded && !am_i_leader() && leader)
+        {
+            // the sender took us for the leader, its client is redirected rather than us dueling with the real one
+            m_l->info("Forwarded a proposal, but {} leads", int(leader_id));
+            return leader_id;
+        }
+        if (!forwarded && !am_i_leader() && leader)
+        {
+            m_l->info("Forwarding to {}", int(leader_id));
+            try
+            {
+                auto id = leader->propose(val).get();
+                // the leader handled it, the redirect is invisible to the client
+                return id == leader_id ? m_node_id : id;
+            }
+            catch (std::exception& err)
+            {
+                m_l->info("Forwarding failed: {}", err.what());
+                return get_leader_id();
+            }
+        }
+
+        if (![this] { std::shared_lock<std::shared_mutex> lk{m_log_prot}; return voter(); }())
+        {
+            m_l->info("Learners don't run consensus and there is no leader to forward to");
+            return 0xFF;
+        }
+
+        std::unique_lock<std::mutex> lk{m_propose_prot};
+
+        // the attempt we queued behind may have been this very request
+        if (auto at = find_decided(val))
+        {
+            m_l->info("Request already decided in {}", *at);
+            ++m_deduplicated;
+            return m_node_id;
+        }
+
+        // leadership was handed over while we waited, the successor takes it
+        if (!am_i_leader() && get_leader())
+        {
+            lk.unlock();
+            return propose(val, forwarded);
+        }
+
+        auto log_index = get_first_hole();
+        if (log_index == -1)
+        {
+            log_index = get_last_log() + 1;
+        }
+        m_l->info("Proposing log index: {}", log_index);
+
+        if (am_i_leader())
+        {
+            m_l->info("Taking the fast route");
+            auto p1res = std::make_pair(paxos::ballot{ 1, m_node_id, log_index }, val);
+            m_l->info("{}", phase_two(p1res));
+        }
+        else if (!get_leader())
+        {
+            m_l->info("Taking the slow route :(");
+            auto p1res = phase_one(val, log_index);
+            if (p1res) {
+                m_l->info("{}", phase_two(*p1res));
+            }
+        }
+
+        return get_leader_id();
+    }
+
+    void local_end::start_hb_thread()
+    {
+        std::call_once(m_hb_once, [this] {
+            m_hb_thread = std::thread([this] {
+               while (m_running) {
+                   auto began = clock::now();
+                   if (am_i_leader()) {
+                       send_heartbeats();
+                   }
+                   auto spent = clock::now() - began;
+                   //m_l->info("Send took {} ms", std::chrono::duration_cast<std::chrono::milliseconds>(spent).count());
+                   std::this_thread::sleep_for(hb_period() - spent);
+               }
+            });
+        });
+    }
+
+    void local_end::start_election_thread()
+    {
+        if (m_election_thread.joinable()) return;
+        m_election_thread = std::thread([this] {
+            std::uniform_real_distribution<double> jitter(1.0, 2.0);
+            auto next_timeout = [&] {
+                return std::chrono::duration_cast<clock::duration>(follower_timeout() * jitter(m_rng));
+            };
+
+            auto timeout = next_timeout();
+            auto last_attempt = clock::now();
+            while (m_running)
+            {
+                std::this_thread::sleep_for(hb_period());
+                if (am_i_leader()) continue;
+
+                auto silent_since = std::max(m_last_hb.load(), last_attempt);
+                if (clock::now() - silent_since < timeout) continue;
+
+                auto members = [this] {
+                    std::shared_lock<std::shared_mutex> lk{m_log_prot};
+                    return m_state.members(m_state.last_log + 1);
+                }();
+                if (std::find(members.begin(), members.end(), m_node_id) != members.end() && pre_vote())
+                {
+                    m_l->info("Leader {} went silent, running an election", int(m_curr_leader));
+                    run_election();
+                }
+
+                last_attempt = clock::now();
+                timeout = next_timeout();
+            }
+        });
+    }
+
+    bool local_end::pre_vote() {
+        using namespace std;
+        vector<future<bool>> futs;
+
+        auto last_log = get_last_log();
+        auto config = get_config(last_log + 1);
+        for (auto& remote : config)
+        {
+            futs.push_back(m_conns_[remote]->pre_vote(m_node_id, last_log));
+        }
+
+        // the election that follows needs a phase one quorum, with our own vote
+        auto voters = int(config.size()) + 1;
+        quorum_tracker tally(quorum_sizes().phase_one(voters), voters);
+        tally.vote(true);
+        for (auto& fut : futs)
+        {
+            if (tally.settled()) break;
+            try
+            {
+                tally.vote(fut.get());
+            }
+            catch (std::exception&)
+            {
+                tally.vote(false);
+            }
+        }
+
+        return tally.reached();
+    }
+
+    void local_end::run_election() {
+        trace::context ctx{trace::new_id(m_node_id)};
+        std::lock_guard<std::mutex> lk{m_propose_prot};
+
+        auto log_index = get_first_hole();
+        if (log_index == -1)
+        {
+            log_index = get_last_log() + 1;
+        }
+
+        // a no-op still finishes whatever value a dead leader left behind in the slot
+        auto p1res = phase_one(paxos::value{}, log_index);
+        if (p1res)
+        {
+            m_l->info("Election on {}: {}", log_index, phase_two(*p1res));
+        }
+    }
+
+    uint8_t local_end::pick_successor() {
+        auto members = get_config(get_last_log() + 1);
+        std::lock_guard<std::mutex> lk{m_repl_prot};
+        uint8_t best = 0xFF;
+        int best_match = -1;
+        for (auto node : members)
+        {
+            auto it = m_progress.find(node);
+            if (it != m_progress.end() && it->second.match > best_match)
+            {
+                best = node;
+                best_match = it->second.match;
+            }
+        }
+        return best;
+    }
+
+    bool local_end::transfer_leadership(uint8_t to) {
+        // proposals queue up behind us until the successor is in charge
+        std::unique_lock<std::mutex> lk{m_propose_prot};
+        if (!am_i_leader())
+        {
+            return false;
+        }
+
+        if (to == 0xFF)
+        {
+            to = pick_successor();
+        }
+        auto members = get_config(get_last_log() + 1);
+        if (std::find(members.begin(), members.end(), to) == members.end())
+        {
+            m_l->info("Can't hand leadership to {}, it isn't a voter", int(to));
+            return false;
+        }
+
+        // heartbeats tell us what it has applied, the replicator pushes it the rest
+        auto last = get_last_log();
+        auto give_up = clock::now() + transfer_catch_up;
+        while (true)
+        {
+            int applied = -1;
+            try
+            {
+                applied = m_conns_[to]->heartbeat(m_node_id, m_hb_period_ms).get();
+            }
+            catch (std::exception&)
+            {
+            }
+            if (applied >= last)
+            {
+                break;
+            }
+            if (applied >= 0)
+            {
+                note_progress(to, applied, last);
+            }
+            if (clock::now() > give_up)
+            {
+                m_l->info("{} didn't catch up to {}, keeping leadership", int(to), last);
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+
+        // step down first so our heartbeats stop and whatever reaches us is forwarded to it
+        m_l->info("Handing leadership to {} at {}", int(to), last);
+        m_curr_leader = to;
+        m_last_hb = clock::now();
+
+        bool took = false;
+        try
+        {
+            took = m_conns_[to]->timeout_now(m_node_id, last).get();
+        }
+        catch (std::exception& err)
+        {
+            m_l->info("Handing over failed: {}", err.what());
+        }
+        lk.unlock();
+
+        if (!took)
+        {
+            // nobody is in charge now, take it back rather than have everyone wait out the timeouts
+            m_l->info("{} didn't take over, running an election", int(to));
+            run_election();
+        }
+        return took;
+    }
+
+    bool local_end::take_over(uint8_t from, int last_log) {
+        {
+            std::shared_lock<std::shared_mutex> lk{m_log_prot};
+            if (!voter())
+            {
+                return false;
+            }
+        }
+        if (get_last_log() < last_log)
+        {
+            m_l->info("{} wants us to lead, but we only have {} of {}", int(from), get_last_log(), last_log);
+            return false;
+        }
+
+        m_l->info("Taking over from {}", int(from));
+        run_election();
+        return am_i_leader();
+    }
+
+    local_end::clock::duration local_end::hb_period() const {
+        return std::chrono::milliseconds(m_hb_period_ms.load());
+    }
 
-        if (count >= ((config.size() / 2) + 1))
-        {
-            // decide
-            for (auto& remote : config)
-            {
-                m_conns_[remote]->inform(p1res.first, p1res.second);
-            }
-            inform(p1res.first, p1res.second);
-            m_curr_leader = m_node_id;
-            m_last_hb = clock::now();
-            start_hb_thread();
-            return true;
-        }
-        return false;
+    local_end::clock::duration local_end::leader_lease() const {
+        return 3 * hb_period();
     }
 
-    void local_end::start_hb_thread()
-    {
-        if (m_running) return;
-        m_running = true;
-        m_hb_thread = std::thread([this] {
-           while (m_running) {
-               if (!am_i_leader()) continue;
-               auto began = clock::now();
-               send_heartbeats();
-               auto spent = clock::now() - began;
-               //m_l->info("Send took {} ms", std::chrono::duration_cast<std::chrono::milliseconds>(spent).count());
-               std::this_thread::sleep_for(std::chrono::milliseconds(300) - spent);
-           }
-        });
+    local_end::clock::duration local_end::follower_timeout() const {
+        // longer than the lease, an old leader steps down before anyone replaces it
+        return 4 * hb_period();
     }
 
     local_end::~local_end() {
-        m_running = false;
+        // no more calls from co-located peers, and none of theirs still running
+        for (auto& l : m_links)
+        {
+            l->close();
+        }
+        m_shm->stop();
+
+        {
+            std::lock_guard<std::mutex> lk{m_catch_up_prot};
+            m_running = false;
+        }
+        m_catch_up_cv.notify_one();
+        if (m_catch_up_thread.joinable())
+        {
+            m_catch_up_thread.join();
+        }
+        {
+            std::lock_guard<std::mutex> lk{m_escrow_prot};
+            m_refill_cv.notify_all();
+        }
+        if (m_refill_thread.joinable())
+        {
+            m_refill_thread.join();
+        }
+        {
+            std::lock_guard<std::mutex> lk{m_repl_prot};
+            m_repl_cv.notify_one();
+        }
+        if (m_repl_thread.joinable())
+        {
+            m_repl_thread.join();
+        }
         if (m_hb_thread.joinable())
         {
             m_hb_thread.join();
         }
+        if (m_election_thread.joinable())
+        {
+            m_election_thread.join();
+        }
     }
 
     bool local_end::send_heartbeats() {
@@ -247,33 +1337,75 @@ namespace paxos
         }
 
         using namespace std;
-        vector<future<bool>> proms;
+        vector<future<int>> proms;
+
+        // what everyone should have applied by the time they answer
+        int owed;
+        {
+            std::shared_lock<std::shared_mutex> lk{m_log_prot};
+            owed = m_state.last_log;
+        }
 
-        auto config = m_state.get_config(get_last_log());
+        auto began = clock::now();
+        auto config = get_config(get_last_log());
         for (auto& remote : config)
         {
-            proms.push_back(m_conns_[remote]->heartbeat(m_node_id));
+            proms.push_back(m_conns_[remote]->heartbeat(m_node_id, m_hb_period_ms));
         }
 
-        vector<bool> results;
+        // learners don't count, but their progress is tracked all the same
+        auto learner_ids = learners(get_last_log());
+        vector<future<int>> learner_proms;
+        for (auto& remote : learner_ids)
+        {
+            learner_proms.push_back(m_conns_[remote]->heartbeat(m_node_id, m_hb_period_ms));
+        }
 
-        for (auto& prom : proms)
+        // still leading if a phase two quorum follows us, every phase one quorum meets it then
+        auto voters = int(config.size()) + 1;
+        quorum_tracker tally(quorum_sizes().phase_two(voters), voters);
+        tally.vote(true);
+        auto quorum_rtt = clock::duration::zero();
+
+        for (size_t i = 0; i < proms.size(); ++i)
         {
             try
             {
-                results.push_back(prom.get());
+                auto applied = proms[i].get();
+                auto was_reached = tally.reached();
+                tally.vote(applied >= 0);
+                note_progress(config[i], applied, owed);
+                if (!was_reached && tally.reached())
+                {
+                    quorum_rtt = clock::now() - began;
+                }
             }
             catch (std::exception&)
             {
-                results.push_back(false);
+                tally.vote(false);
             }
         }
 
-        int count = std::count(results.begin(), results.end(), true);
+        for (size_t i = 0; i < learner_proms.size(); ++i)
+        {
+            try
+            {
+                note_progress(learner_ids[i], learner_proms[i].get(), owed);
+            }
+            catch (std::exception&)
+            {
+            }
+        }
 
-        if (count >= config.size() / 2)
+        if (tally.reached())
         {
             m_last_hb = clock::now();
+
+            // keep the period a few quorum round trips long, within sane bounds
+            auto sample = int(std::chrono::duration_cast<std::chrono::microseconds>(quorum_rtt).count());
+            auto rtt = m_rtt_us == 0 ? sample : (7 * m_rtt_us + sample) / 8;
+            m_rtt_us = rtt;
+            m_hb_period_ms = std::clamp(4 * rtt / 1000, 30, 300);
             return true;
         }
 
@@ -281,7 +1413,7 @@ namespace paxos
     }
 
     bool local_end::am_i_leader() const {
-        if (clock::now() - m_last_hb.load(std::memory_order_relaxed) > std::chrono::milliseconds(750))
+        if (clock::now() - m_last_hb.load(std::memory_order_relaxed) > leader_lease())
         {
             return false;
         }
@@ -289,11 +1421,12 @@ namespace paxos
     }
 
     paxos::remote_end *local_end::get_leader() {
-        if (clock::now() - m_last_hb.load(std::memory_order_relaxed) > std::chrono::seconds(1) || m_curr_leader == 0xFF)
+        if (clock::now() - m_last_hb.load(std::memory_order_relaxed) > follower_timeout() || m_curr_leader == 0xFF)
         {
             return nullptr;
         }
-        return m_conns_[m_curr_leader];
+        auto it = m_conns_.find(m_curr_leader);
+        return it == m_conns_.end() ? nullptr : it->second;
     }
 
     uint8_t local_end::get_leader_id() {
@@ -302,7 +1435,7 @@ namespace paxos
             return m_node_id;
         }
 
-        if (clock::now() - m_last_hb.load(std::memory_order_relaxed) < std::chrono::seconds(1))
+        if (clock::now() - m_last_hb.load(std::memory_order_relaxed) < follower_timeout())
         {
             return m_curr_leader;
         }
@@ -310,78 +1443,198 @@ namespace paxos
         return 0xFF;
     }
 
+    std::chrono::milliseconds local_end::staleness() const {
+        if (am_i_leader())
+        {
+            return std::chrono::milliseconds(0);
+        }
+        return std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - m_last_hb.load());
+    }
+
+    bool local_end::voter() const {
+        return !m_learner || m_state.promoted(m_node_id);
+    }
+
+    std::vector<uint8_t> local_end::learners(int for_log) const {
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        auto members = m_state.members(for_log);
+        std::vector<uint8_t> res;
+        for (auto l : m_learners)
+        {
+            if (std::find(members.begin(), members.end(), l) == members.end())
+            {
+                res.push_back(l);
+            }
+        }
+        return res;
+    }
+
     paxos::promise local_end::prepare(paxos::ballot bal) {
-        m_l->info("Got prepare {}", bal);
-        if (bal > m_log[bal.log_index].m_cur_bal && !m_log[bal.log_index].m_commited)
+        PAXOS_TRACE_SPAN(1, prepare, bal.log_index);
+        PAXOS_TRACE(1, prepare_recv, bal.log_index, bal.number, bal.node_id);
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        auto& slot = shared_entry(bal.log_index, lk);
+        std::unique_lock<std::mutex> slot_lk{stripe(bal.log_index)};
+        if (voter() && bal > slot.cur_bal(bal.log_index) && !slot.m_commited)
         {
-            m_log[bal.log_index].m_cur_bal = bal;
-            dump_log();
-            m_l->info("Sending {}", m_log[bal.log_index].m_val.ts);
-            return { bal, m_log[bal.log_index].m_accept_bal, m_log[bal.log_index].m_val, true };
+            slot.m_cur_bal = bal.pack();
+            auto seq = dump_log(bal.log_index);
+            paxos::promise res{ bal, slot.accept_bal(bal.log_index), slot.m_val, true };
+            slot_lk.unlock();
+            lk.unlock();
+
+            {
+                PAXOS_TRACE_SPAN(1, persist, bal.log_index);
+                m_store.wait(seq);
+            }
+            auto [p1, p2] = payload(res.accept_val);
+            PAXOS_TRACE(1, prepare_promise, bal.log_index, bal.number, bal.node_id, res.accept_val.type(), p1, p2);
+            return res;
         }
-        m_l->info("Rejecting...");
-        return { bal, m_log[bal.log_index].m_accept_bal, m_log[bal.log_index].m_val, false };
+        PAXOS_TRACE(1, prepare_reject, bal.log_index, bal.number, bal.node_id);
+        return { bal, slot.accept_bal(bal.log_index), slot.m_val, false };
     }
 
     bool local_end::accept(paxos::ballot bal, paxos::value val) {
-        if (val.type == 0) {
-            if (m_state.sold_tickets + val.ts.ticket_count > 100) {
+        PAXOS_TRACE_SPAN(1, accept, bal.log_index);
+        auto [p1, p2] = payload(val);
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        if (auto ts = val.ts()) {
+            if (m_state.sold_tickets + m_state.escrowed() + ts->ticket_count > 100) {
+                PAXOS_TRACE(1, accept_reject, bal.log_index, bal.number, bal.node_id, val.type(), p1, p2);
                 return false;
             }
-            /*if (val.ts.client_id != bal.node_id) {
+            /*if (ts->client_id != bal.node_id) {
                 return false;
             }*/
         }
-        if (bal >= m_log[bal.log_index].m_cur_bal && !m_log[bal.log_index].m_commited)
+        if (auto qt = val.qt()) {
+            // quotas come out of the same 100 tickets
+            if (qt->delta > 0 && m_state.sold_tickets + m_state.escrowed() + qt->delta > 100) {
+                PAXOS_TRACE(1, accept_reject, bal.log_index, bal.number, bal.node_id, val.type(), p1, p2);
+                return false;
+            }
+        }
+        auto& slot = shared_entry(bal.log_index, lk);
+        std::unique_lock<std::mutex> slot_lk{stripe(bal.log_index)};
+        if (voter() && bal >= slot.cur_bal(bal.log_index) && !slot.m_commited)
         {
-            m_log[bal.log_index].m_accept_bal = bal;
-            m_log[bal.log_index].m_val = val;
+            slot.m_accept_bal = bal.pack();
+            slot.m_val = val;
             m_curr_leader = bal.node_id;
             m_last_hb = clock::now();
-            m_l->info("Accepted: {}, {}", val.ts, bal);
-            dump_log();
+            auto seq = dump_log(bal.log_index);
+            slot_lk.unlock();
+            lk.unlock();
+
+            {
+                PAXOS_TRACE_SPAN(1, persist, bal.log_index);
+                m_store.wait(seq);
+            }
+            PAXOS_TRACE(1, accept_ok, bal.log_index, bal.number, bal.node_id, val.type(), p1, p2);
             return true;
         }
+        PAXOS_TRACE(1, accept_reject, bal.log_index, bal.number, bal.node_id, val.type(), p1, p2);
         return false;
     }
 
     void local_end::inform(paxos::ballot b, paxos::value val) {
-        if (val != m_log[b.log_index].m_val)
+        PAXOS_TRACE_SPAN(1, inform, b.log_index);
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        auto& slot = shared_entry(b.log_index, lk);
+        std::unique_lock<std::mutex> slot_lk{stripe(b.log_index)};
+        // what we accepted under an older ballot lost, only our own piece of this one is worth keeping
+        if (!(slot.m_val.fr() && slot.accept_bal(b.log_index) == b))
         {
-            throw std::runtime_error("bad");
+            slot.m_val = val;
+        }
+        slot.m_commited = true;
+        auto seq = dump_log(b.log_index);
+        slot_lk.unlock();
+        lk.unlock();
+        {
+            PAXOS_TRACE_SPAN(1, persist, b.log_index);
+            m_store.wait(seq);
         }
-
-        m_log[b.log_index].m_commited = true;
         /*for (auto it = m_log.find(b.log_index); it != m_log.end(); ++it)
         {
             if (!it->second.m_commited) break;
             m_state.apply(it->first, it->second.m_val);
         }*/
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        learn_log();
-        dump_log();
+        auto [p1, p2] = payload(val);
+        PAXOS_TRACE(1, decided, b.log_index, b.number, b.node_id, val.type(), p1, p2);
 
-        std::cout << int(m_node_id) << " - " << b.log_index << " DECIDED " << val.ts << " " << b << "\n";
+        {
+            std::lock_guard<std::shared_mutex> lk{m_log_prot};
+            apply_committed();
+        }
+
+        // slots we missed before this one are pushed by the leader's replicator
     }
 
     void local_end::state::apply(int log, const value &v) {
         if (last_log + 1 != log) return;
-        std::cout << v.type << "\n";
 
-        if (v.type == 0)
+        if (auto ts = v.ts())
+        {
+            if (ts->session != 0)
+            {
+                auto& s = m_sessions[ts->session];
+                if (ts->request <= s.request)
+                {
+                    // a retry that made it into the log twice, the purchase already happened
+                    last_log = log;
+                    return;
+                }
+                s = { ts->request, log };
+            }
+            sold_tickets += ts->ticket_count;
+        }
+        else if (auto cc = v.cc())
+        {
+            m_changes.push_back({ log, *cc });
+        }
+        else if (auto qt = v.qt())
         {
-            sold_tickets += v.ts.ticket_count;
+            auto& e = m_escrow[qt->node_id];
+            auto sold = std::max(0, qt->sold - e.reported);
+            e.reported += sold;
+            sold_tickets += sold;
+            if (qt->delta > 0)
+            {
+                // acceptors check grants against their own, maybe stale, state; every
+                // replica drops the ones that no longer fit here alike
+                if (sold_tickets + escrowed() + qt->delta <= 100)
+                {
+                    e.granted += qt->delta;
+                }
+            }
+            else
+            {
+                e.returned -= qt->delta;
+            }
         }
-        else if(v.type == 1)
+        else if (auto pr = v.pr())
         {
-            m_changes.push_back({ log, v.cc });
+            m_promotions.emplace_back(log, pr->node_id);
         }
 
         last_log = log;
-        std::cout << log << " STATE APPLIED\n";
+
+        if (log % 1024 == 0)
+        {
+            // driven by the slot number so every replica forgets the same sessions
+            for (auto it = m_sessions.begin(); it != m_sessions.end();)
+            {
+                it = it->second.log_index + session_expiry < log ? m_sessions.erase(it) : std::next(it);
+            }
+        }
+
+        auto [p1, p2] = payload(v);
+        PAXOS_TRACE(1, applied, log, sold_tickets, v.type(), p1, p2);
     }
 
-    std::vector<uint8_t> local_end::state::get_config(int for_log) const {
+    std::vector<uint8_t> local_end::state::members(int for_log) const {
         std::vector<uint8_t> res{0, 1, 2};
         for (auto& cc : m_changes)
         {
@@ -391,30 +1644,160 @@ namespace paxos
                 res.push_back(cc.chg.new_node2);
             }
         }
+        for (auto& [log_index, node] : m_promotions)
+        {
+            if (log_index + 3 <= for_log && std::find(res.begin(), res.end(), node) == res.end())
+            {
+                res.push_back(node);
+            }
+        }
+        return res;
+    }
+
+    std::vector<uint8_t> local_end::state::get_config(int for_log) const {
+        auto res = members(for_log);
         res.erase(std::remove(res.begin(), res.end(), m_node_id), res.end());
         return res;
     }
 
-    void local_end::add_endpoint(uint8_t node_id, boost::string_view host, uint16_t port) {
+    paxos::snapshot local_end::state::take_snapshot() const {
+        paxos::snapshot res;
+        res.last_log = last_log;
+        res.sold_tickets = sold_tickets;
+        for (auto& c : m_changes)
+        {
+            res.changes.emplace_back(c.log_index, c.chg);
+        }
+        for (auto& s : m_sessions)
+        {
+            res.sessions.emplace_back(s.first, s.second.request, s.second.log_index);
+        }
+        for (auto& e : m_escrow)
+        {
+            res.escrow.emplace_back(e.first, e.second.granted, e.second.returned, e.second.reported);
+        }
+        res.promotions = m_promotions;
+        return res;
+    }
+
+    void local_end::state::restore(const paxos::snapshot &snap) {
+        last_log = snap.last_log;
+        sold_tickets = snap.sold_tickets;
+        m_changes.clear();
+        for (auto& c : snap.changes)
+        {
+            m_changes.push_back({ c.first, c.second });
+        }
+        m_sessions.clear();
+        for (auto& [id, request, log_index] : snap.sessions)
+        {
+            m_sessions[id] = { request, log_index };
+        }
+        m_escrow.clear();
+        for (auto& [node, granted, returned, reported] : snap.escrow)
+        {
+            m_escrow[node] = { granted, returned, reported };
+        }
+        m_promotions = snap.promotions;
+    }
+
+    bool local_end::state::promoted(int node) const {
+        return std::any_of(m_promotions.begin(), m_promotions.end(), [node](auto& p) { return p.second == node; });
+    }
+
+    local_end::state::escrow local_end::state::escrow_of(int node) const {
+        auto it = m_escrow.find(node);
+        return it == m_escrow.end() ? escrow{} : it->second;
+    }
+
+    int local_end::state::escrowed() const {
+        int res = 0;
+        for (auto& e : m_escrow)
+        {
+            res += e.second.granted - e.second.returned - e.second.reported;
+        }
+        return res;
+    }
+
+    boost::optional<int> local_end::state::decided(const ticket_sell &ts) const {
+        auto it = m_sessions.find(ts.session);
+        if (ts.session == 0 || it == m_sessions.end() || ts.request > it->second.request)
+        {
+            return {};
+        }
+        return it->second.log_index;
+    }
+
+    boost::optional<int> local_end::find_decided(const paxos::value &val) const {
+        auto ts = val.ts();
+        if (!ts || ts->session == 0)
+        {
+            return {};
+        }
+
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        if (auto at = m_state.decided(*ts))
+        {
+            return at;
+        }
+
+        // decided but not applied yet, only the tail past the state can hold it
+        for (auto it = m_log.upper_bound(m_state.last_log); it != m_log.end(); ++it)
+        {
+            std::lock_guard<std::mutex> slot_lk{stripe(it->first)};
+            auto other = it->second.m_val.ts();
+            if (it->second.m_commited && other && other->session == ts->session && other->request == ts->request)
+            {
+                return it->first;
+            }
+        }
+        return {};
+    }
+
+    void local_end::add_endpoint(uint8_t node_id, boost::string_view host, uint16_t port, bool learner) {
         auto it = m_conns_.find(node_id);
         if (it != m_conns_.end())
         {
             // already exists, return
             return;
         }
-        m_conns_.emplace(node_id, new paxos::remote_end(host, port));
+        if (learner)
+        {
+            m_learners.push_back(node_id);
+        }
+        auto conn = new paxos::remote_end(host, port);
+        if (m_shm_on && m_port != 0 && shm::is_local(std::string(host)))
+        {
+            try
+            {
+                auto l = std::make_shared<shm::link>(m_port, port, m_shm);
+                conn->set_link(l);
+                m_links.push_back(std::move(l));
+            }
+            catch (std::exception& err)
+            {
+                m_l->warn("Talking to {} over TCP, no shared memory: {}", int(node_id), err.what());
+            }
+        }
+        m_conns_.emplace(node_id, conn);
+    }
+
+    void local_end::set_shared_memory(bool on) {
+        m_shm_on = on;
     }
 
     uint8_t local_end::discover_leader() const {
         using namespace std;
         vector<future<uint8_t>> proms;
 
-        auto config = m_state.get_config(get_last_log() + 1);
+        auto config = get_config(get_last_log() + 1);
         for (auto& remote : config)
         {
             proms.push_back(m_conns_.find(remote)->second->get_leader_id());
         }
 
+        // the others agreeing on it, with us a majority
+        auto needed = quorums::majority(int(config.size()) + 1) - 1;
         map<uint8_t, int> results;
 
         for (auto& prom : proms)
@@ -424,7 +1807,7 @@ namespace paxos
                 auto l = prom.get();
                 results[l]++;
                 m_l->info("Discovering... {}", l);
-                if (results[l] >= (config.size() / 2))
+                if (results[l] >= needed)
                 {
                     return l;
                 }
@@ -433,7 +1816,7 @@ namespace paxos
             {
                 results[0xFF]++;
                 m_l->info("Down... 255");
-                if (results[0xFF] >= (config.size() / 2))
+                if (results[0xFF] >= needed)
                 {
                     return 0xFF;
                 }
@@ -443,58 +1826,241 @@ namespace paxos
         return 0xFF;
     }
 
-    void local_end::dump_log() {
-        namespace msgpack = RPCLIB_MSGPACK;
-        msgpack::sbuffer sbuf;
-        msgpack::pack(sbuf, m_log);
-        std::ofstream out("log" + std::to_string(m_node_id) + ".mpk");
-        out.write(sbuf.data(), sbuf.size());
+    uint64_t local_end::dump_log(int index) {
+        // at() doesn't insert, shared holders may be calling this
+        return m_store.append(index, m_log.at(index));
     }
 
     void local_end::load_log()
     {
-        namespace msgpack = RPCLIB_MSGPACK;
+        m_store.open();
 
-        std::ifstream in("log" + std::to_string(m_node_id) + ".mpk");
+        auto snap_bytes = m_store.load_snapshot();
+        if (!snap_bytes.empty())
+        {
+            auto oh = msgpack::unpack(snap_bytes.data(), snap_bytes.size());
+            m_state.restore(oh.get().as<paxos::snapshot>());
+            m_snap_base = m_state.last_log;
+        }
 
-        if (!in.good())
+        // replay the committed prefix straight from the mapping
+        for (int i = m_state.last_log + 1; i < m_store.end_index(); ++i)
         {
-            return;
+            if (!m_store.contains(i)) break;
+            auto e = m_store.read(i);
+            if (!e.m_commited) break;
+            m_state.apply(i, e.m_val);
+        }
+
+        // only the undecided tail is materialized, older slots are read on demand
+        for (int i = m_state.last_log + 1; i < m_store.end_index(); ++i)
+        {
+            if (m_store.contains(i))
+            {
+                m_log[i] = m_store.read(i);
+            }
         }
+    }
 
-        std::string buffer((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
-        msgpack::unpacker pac;
-        pac.reserve_buffer(buffer.size());
-        std::copy(buffer.begin(), buffer.end(), pac.buffer());
-        pac.buffer_consumed(buffer.size());
+    log_entry& local_end::entry(int index) {
+        auto it = m_log.lower_bound(index);
+        if (it != m_log.end() && it->first == index)
+        {
+            return it->second;
+        }
 
-        msgpack::object_handle oh;
-        pac.next(oh);
+        it = m_log.emplace_hint(it, index, log_entry{});
+        if (m_store.contains(index))
+        {
+            it->second = m_store.read(index);
+        }
+        return it->second;
+    }
 
-        oh.get().convert(m_log);
-        for (auto& l : m_log)
+    log_entry& local_end::shared_entry(int index, std::shared_lock<std::shared_mutex>& lk) {
+        while (true)
         {
-            if (!l.second.m_commited) break;
-            m_state.apply(l.first, l.second.m_val);
+            auto it = m_log.find(index);
+            if (it != m_log.end())
+            {
+                return it->second;
+            }
+
+            lk.unlock();
+            {
+                std::lock_guard<std::shared_mutex> ex{m_log_prot};
+                entry(index);
+            }
+            // a snapshot may have dropped it again in between
+            lk.lock();
         }
     }
 
-    void local_end::learn_log() {
-        auto leader = get_leader();
-        if (leader)
+    std::mutex& local_end::stripe(int index) const {
+        return m_stripes[unsigned(index) % slot_stripes];
+    }
+
+    std::map<int, log_entry> local_end::get_committed(int from, int limit, bool accepted) {
+        std::shared_lock<std::shared_mutex> lk{m_log_prot};
+        std::map<int, log_entry> res;
+        auto end = std::max(m_store.end_index(), m_log.empty() ? 0 : m_log.rbegin()->first + 1);
+        for (int i = std::max(from, 0); i < end && int(res.size()) < limit; ++i)
+        {
+            auto it = m_log.find(i);
+            if (it != m_log.end())
+            {
+                std::lock_guard<std::mutex> slot_lk{stripe(i)};
+                // undecided slots only ever live in m_log
+                auto ours = accepted && it->second.accept_bal(i).node_id == m_node_id && it->second.m_val != paxos::value{};
+                if (it->second.m_commited || ours)
+                {
+                    res.emplace(i, it->second);
+                }
+            }
+            else if (m_store.contains(i))
+            {
+                auto e = m_store.read(i);
+                if (e.m_commited)
+                {
+                    res.emplace(i, std::move(e));
+                }
+            }
+        }
+        return res;
+    }
+
+    paxos::snapshot_chunk local_end::get_snapshot(int last_log, uint64_t offset) {
+        std::lock_guard<std::mutex> lk{m_snap_prot};
+        if (last_log == -1)
+        {
+            auto snap = [this] {
+                std::shared_lock<std::shared_mutex> lk{m_log_prot};
+                return m_state.take_snapshot();
+            }();
+
+            // joiners arriving while nothing was applied share the same copy
+            if (!m_snap_bytes || snap.last_log != m_snap_last_log)
+            {
+                msgpack::sbuffer sbuf;
+                msgpack::pack(sbuf, snap);
+                m_snap_bytes = std::make_shared<const std::vector<char>>(sbuf.data(), sbuf.data() + sbuf.size());
+                m_snap_last_log = snap.last_log;
+            }
+            last_log = m_snap_last_log;
+        }
+
+        paxos::snapshot_chunk res;
+        res.last_log = m_snap_last_log;
+        if (last_log != m_snap_last_log || !m_snap_bytes)
+        {
+            return res;
+        }
+
+        auto& bytes = *m_snap_bytes;
+        res.total = bytes.size();
+        res.offset = std::min<uint64_t>(offset, bytes.size());
+        auto end = std::min<uint64_t>(res.offset + snapshot_chunk_size, bytes.size());
+        res.data.assign(bytes.begin() + res.offset, bytes.begin() + end);
+        return res;
+    }
+
+    bool local_end::install_snapshot(paxos::remote_end &from) {
+        std::vector<char> bytes;
+        auto chunk = from.get_snapshot(-1, 0).get();
+        auto last_log = chunk.last_log;
+        bytes.reserve(chunk.total);
+        while (true)
+        {
+            if (chunk.last_log != last_log || chunk.offset != bytes.size())
+            {
+                // the leader moved on to a newer snapshot, the log will do for now
+                return false;
+            }
+            bytes.insert(bytes.end(), chunk.data.begin(), chunk.data.end());
+            if (bytes.size() >= chunk.total || chunk.data.empty())
+            {
+                break;
+            }
+            chunk = from.get_snapshot(last_log, bytes.size()).get();
+        }
+
+        auto oh = msgpack::unpack(bytes.data(), bytes.size());
+        auto snap = oh.get().as<paxos::snapshot>();
         {
-            auto rest = leader->get_log_entry(m_state.last_log);
-            for (auto& l : rest.get())
+            std::shared_lock<std::shared_mutex> lk{m_log_prot};
+            if (snap.last_log <= m_state.last_log)
             {
-                m_log[l.first] = l.second;
+                return false;
             }
         }
 
-        for (auto& l : m_log)
+        // on disk first, the slots it covers may never show up in our log
+        m_store.save_snapshot(bytes);
+
+        std::lock_guard<std::shared_mutex> lk{m_log_prot};
+        if (snap.last_log <= m_state.last_log)
+        {
+            return false;
+        }
+        m_state.restore(snap);
+        m_snap_base = snap.last_log;
+        m_log.erase(m_log.begin(), m_log.upper_bound(snap.last_log));
+        m_l->info("Installed snapshot at {} ({} bytes)", snap.last_log, bytes.size());
+        return true;
+    }
+
+    void local_end::learn_log() {
+        PAXOS_TRACE_SPAN(1, learn_log, -1);
+        auto leader = get_leader();
+        if (!leader)
+        {
+            std::lock_guard<std::shared_mutex> lk{m_log_prot};
+            apply_committed();
+            return;
+        }
+
+        int from;
+        {
+            std::shared_lock<std::shared_mutex> lk{m_log_prot};
+            from = m_state.last_log;
+        }
+
+        // far behind, or behind what the leader still keeps: take the state instead of the history
+        auto [base, last] = leader->get_log_bounds().get();
+        if ((from < base || last - from > snapshot_lag) && install_snapshot(*leader))
         {
-            if (!l.second.m_commited) break;
-            m_state.apply(l.first, l.second.m_val);
+            std::shared_lock<std::shared_mutex> lk{m_log_prot};
+            from = m_state.last_log;
+        }
+
+        // page by page, so neither side ever holds the whole tail at once
+        uint64_t seq = 0;
+        while (true)
+        {
+            auto page = leader->get_log_entry(from, catch_up_batch).get();
+            {
+                std::lock_guard<std::shared_mutex> lk{m_log_prot};
+                for (auto& l : page)
+                {
+                    auto& slot = entry(l.first);
+                    if (slot.m_commited) continue;
+                    if (keep_ours(slot, l.second))
+                    {
+                        slot.m_commited = true;
+                    }
+                    else
+                    {
+                        slot = l.second;
+                    }
+                    seq = dump_log(l.first);
+                }
+                apply_committed();
+            }
+
+            if (page.size() < catch_up_batch) break;
+            from = page.rbegin()->first + 1;
         }
+        m_store.wait(seq);
     }
 
     void local_end::detect_leader() {
@@ -502,6 +2068,6 @@ namespace paxos
         m_last_hb = clock::now();
 
         learn_log();
-        dump_log();
+        start_election_thread();
     }
 }
@@ -0,0 +1,833 @@
+#include <paxos/log_store.hpp>
+#include <paxos/block.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <system_error>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef PAXOS_HAVE_IO_URING
+#include <liburing.h>
+#endif
+
+namespace paxos
+{
+    namespace
+    {
+        namespace msgpack = RPCLIB_MSGPACK;
+
+        // raw bytes per zstd block when sealing the log in compaction
+        constexpr size_t sealed_block = 64 * 1024;
+
+        // decompressed blocks kept for reads
+        constexpr size_t cached_blocks = 4;
+
+        // keep strings pointing into the buffer instead of copying them to the zone
+        bool reference_all(msgpack::type::object_type, size_t, void*)
+        {
+            return true;
+        }
+
+        // positional, so the field names of the wire format aren't repeated for every slot
+        void pack_record(msgpack::sbuffer& sbuf, int index, const log_entry& e)
+        {
+            msgpack::packer<msgpack::sbuffer> pk(sbuf);
+            pk.pack_array(5);
+            pk.pack(index);
+            pk.pack(e.m_cur_bal);
+            pk.pack(e.m_accept_bal);
+            pk.pack(e.m_commited);
+            pk.pack(e.m_val);
+        }
+
+        constexpr int bad_record = INT32_MIN;
+
+        // records are either the old [index, log_entry] or the positional form
+        int record_index(const msgpack::object& o)
+        {
+            if (o.type != msgpack::type::ARRAY || (o.via.array.size != 2 && o.via.array.size != 5))
+            {
+                return bad_record;
+            }
+            return o.via.array.ptr[0].as<int>();
+        }
+
+        log_entry decode_record(const msgpack::object& o)
+        {
+            log_entry res;
+            auto& a = o.via.array;
+            if (a.size == 2)
+            {
+                a.ptr[1].convert(res);
+                return res;
+            }
+            a.ptr[1].convert(res.m_cur_bal);
+            a.ptr[2].convert(res.m_accept_bal);
+            a.ptr[3].convert(res.m_commited);
+            a.ptr[4].convert(res.m_val);
+            return res;
+        }
+
+        // whether the data starts with a bare [index, log_entry] record, as written before blocks
+        bool is_legacy(const char* data, size_t size)
+        {
+            try
+            {
+                size_t off = 0;
+                auto oh = msgpack::unpack(data, size, off, reference_all);
+                auto& o = oh.get();
+                if (o.type != msgpack::type::ARRAY || o.via.array.size != 2 || record_index(o) < 0)
+                {
+                    return false;
+                }
+                o.via.array.ptr[1].as<log_entry>();
+                return true;
+            }
+            catch (std::exception&)
+            {
+                return false;
+            }
+        }
+
+        // whether the data starts with the single int -> log_entry map the log was dumped as before the store
+        bool is_dumped_map(const char* data, size_t size)
+        {
+            try
+            {
+                size_t off = 0;
+                auto oh = msgpack::unpack(data, size, off, reference_all);
+                auto& o = oh.get();
+                if (o.type != msgpack::type::MAP)
+                {
+                    return false;
+                }
+                auto& m = o.via.map;
+                return m.size == 0
+                        || ((m.ptr[0].key.type == msgpack::type::POSITIVE_INTEGER
+                                || m.ptr[0].key.type == msgpack::type::NEGATIVE_INTEGER)
+                            && m.ptr[0].val.type == msgpack::type::MAP);
+            }
+            catch (std::exception&)
+            {
+                return false;
+            }
+        }
+
+        // whether an intact block starts anywhere in the data
+        bool intact_block_in(const char* data, size_t size)
+        {
+            for (auto p = data; p < data + size;)
+            {
+                auto at = static_cast<const char*>(std::memchr(p, 'P', data + size - p));
+                if (!at)
+                {
+                    return false;
+                }
+                block::view v;
+                if (block::parse(at, data + size - at, v) == block::status::ok)
+                {
+                    return true;
+                }
+                p = at + 1;
+            }
+            return false;
+        }
+
+        void write_all(int fd, const char* data, size_t size)
+        {
+            while (size > 0)
+            {
+                auto res = ::write(fd, data, size);
+                if (res < 0)
+                {
+                    if (errno == EINTR) continue;
+                    throw std::system_error(errno, std::generic_category(), "log write");
+                }
+                data += res;
+                size -= res;
+            }
+        }
+
+        void pwrite_all(int fd, const char* data, size_t size, off_t off)
+        {
+            while (size > 0)
+            {
+                auto res = ::pwrite(fd, data, size, off);
+                if (res < 0)
+                {
+                    if (errno == EINTR) continue;
+                    throw std::system_error(errno, std::generic_category(), "log write");
+                }
+                data += res;
+                size -= res;
+                off += res;
+            }
+        }
+
+        void sync(int fd)
+        {
+            if (::fdatasync(fd) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "log sync");
+            }
+        }
+
+        /*
+         * Writes the records fill passes to its argument as zstd blocks to a
+         * temporary file and moves it over path once it's durable. False if
+         * anything failed, path is untouched then.
+         */
+        template <class FillT>
+        bool write_sealed(const std::string& path, FillT&& fill)
+        {
+            auto tmp = path + ".tmp";
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1)
+            {
+                return false;
+            }
+
+            try
+            {
+                msgpack::sbuffer raw;
+                std::string out;
+                auto seal = [&] {
+                    out.clear();
+                    block::encode(block::codec::zstd, raw.data(), raw.size(), out);
+                    write_all(fd, out.data(), out.size());
+                    raw.clear();
+                };
+
+                fill([&](int index, const log_entry& e) {
+                    pack_record(raw, index, e);
+                    if (raw.size() >= sealed_block)
+                    {
+                        seal();
+                    }
+                });
+                if (raw.size() > 0)
+                {
+                    seal();
+                }
+                sync(fd);
+            }
+            catch (std::exception&)
+            {
+                ::close(fd);
+                std::remove(tmp.c_str());
+                return false;
+            }
+            ::close(fd);
+
+            if (std::rename(tmp.c_str(), path.c_str()) != 0)
+            {
+                std::remove(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+    }
+
+    /*
+     * Does the write (and the fdatasync linked to it) of one batch. With
+     * io_uring both go in a single submission, otherwise it's plain pwrite.
+     */
+    struct log_store::writer
+    {
+#ifdef PAXOS_HAVE_IO_URING
+        io_uring m_ring;
+        bool m_ring_ok = false;
+
+        writer()
+        {
+            m_ring_ok = io_uring_queue_init(4, &m_ring, 0) == 0;
+        }
+
+        ~writer()
+        {
+            if (m_ring_ok)
+            {
+                io_uring_queue_exit(&m_ring);
+            }
+        }
+
+        void write(int fd, const char* data, size_t size, off_t off, bool do_sync)
+        {
+            if (!m_ring_ok)
+            {
+                pwrite_all(fd, data, size, off);
+                if (do_sync) sync(fd);
+                return;
+            }
+
+            auto sqe = io_uring_get_sqe(&m_ring);
+            io_uring_prep_write(sqe, fd, data, size, off);
+            sqe->user_data = 0;
+            if (do_sync)
+            {
+                sqe->flags |= IOSQE_IO_LINK;
+                auto fsqe = io_uring_get_sqe(&m_ring);
+                io_uring_prep_fsync(fsqe, fd, IORING_FSYNC_DATASYNC);
+                fsqe->user_data = 1;
+            }
+            io_uring_submit(&m_ring);
+
+            long written = -1;
+            bool synced = !do_sync;
+            for (int i = 0; i < (do_sync ? 2 : 1); ++i)
+            {
+                io_uring_cqe* cqe;
+                auto err = io_uring_wait_cqe(&m_ring, &cqe);
+                if (err < 0)
+                {
+                    throw std::system_error(-err, std::generic_category(), "io_uring wait");
+                }
+                if (cqe->user_data == 0)
+                {
+                    written = cqe->res;
+                }
+                else
+                {
+                    synced = cqe->res == 0;
+                }
+                io_uring_cqe_seen(&m_ring, cqe);
+            }
+
+            if (written < 0 && written != -EINTR && written != -EAGAIN)
+            {
+                throw std::system_error(int(-written), std::generic_category(), "log write");
+            }
+
+            // short write cancels the linked sync, finish the job by hand
+            if (written < long(size) || !synced)
+            {
+                auto done = size_t(std::max(written, 0L));
+                pwrite_all(fd, data + done, size - done, off + done);
+                if (do_sync) sync(fd);
+            }
+        }
+#else
+        void write(int fd, const char* data, size_t size, off_t off, bool do_sync)
+        {
+            pwrite_all(fd, data, size, off);
+            if (do_sync) sync(fd);
+        }
+#endif
+    };
+
+    log_store::log_store(std::string path) : m_path(std::move(path)) {}
+
+    log_store::~log_store()
+    {
+        if (m_flush_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lk{m_queue_prot};
+                m_stopping = true;
+            }
+            m_queue_cv.notify_all();
+            m_flush_thread.join();
+        }
+
+        unmap();
+        if (m_fd != -1)
+        {
+            ::close(m_fd);
+        }
+    }
+
+    void log_store::open()
+    {
+        map();
+        if (m_map_size > 0 && !block::is_block(m_map, m_map_size) && is_dumped_map(m_map, m_map_size))
+        {
+            convert_dumped_map();
+        }
+        build_index();
+
+        if (m_legacy || (m_records > 1024 && m_live * 2 < m_records))
+        {
+            // blocks can't be appended to bare records, an old log has to be converted
+            if (!compact() && m_legacy)
+            {
+                throw std::runtime_error("can't convert " + m_path + " to blocks");
+            }
+        }
+
+        m_fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (m_fd == -1)
+        {
+            throw std::system_error(errno, std::generic_category(), "can't open " + m_path);
+        }
+
+        struct stat st;
+        if (::fstat(m_fd, &st) == 0)
+        {
+            m_write_off = st.st_size;
+        }
+
+        m_writer = std::make_unique<writer>();
+        m_flush_thread = std::thread([this] { flush_loop(); });
+    }
+
+    void log_store::set_durability(durability mode, std::chrono::microseconds window)
+    {
+        m_mode = mode;
+        m_window = window;
+        m_queue_cv.notify_all();
+    }
+
+    void log_store::map()
+    {
+        int fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return;
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            auto p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                m_map = static_cast<const char*>(p);
+                m_map_size = st.st_size;
+            }
+        }
+        ::close(fd);
+    }
+
+    void log_store::unmap()
+    {
+        if (m_map)
+        {
+            ::munmap(const_cast<char*>(m_map), m_map_size);
+        }
+        m_map = nullptr;
+        m_map_size = 0;
+    }
+
+    void log_store::convert_dumped_map()
+    {
+        // the whole file was rewritten on every change, so it's either complete or unusable
+        std::map<int, log_entry> log;
+        try
+        {
+            size_t off = 0;
+            auto oh = msgpack::unpack(m_map, m_map_size, off, reference_all);
+            if (off != m_map_size)
+            {
+                throw std::runtime_error("trailing bytes after the log");
+            }
+            oh.get().convert(log);
+        }
+        catch (std::exception& e)
+        {
+            throw std::runtime_error(m_path + ": can't read the dumped log: " + e.what());
+        }
+
+        auto ok = write_sealed(m_path, [&log](auto&& emit) {
+            for (auto& e : log)
+            {
+                emit(e.first, e.second);
+            }
+        });
+        if (!ok)
+        {
+            throw std::runtime_error("can't convert " + m_path + " to blocks");
+        }
+
+        unmap();
+        map();
+    }
+
+    void log_store::build_index()
+    {
+        m_blocks.clear();
+        m_index.clear();
+        m_live = 0;
+        m_records = 0;
+        m_legacy = false;
+        {
+            std::lock_guard<std::mutex> lk{m_cache_prot};
+            m_cache.clear();
+        }
+
+        if (m_map_size == 0)
+        {
+            return;
+        }
+
+        size_t off = 0;
+        if (!block::is_block(m_map, m_map_size))
+        {
+            // bare records, as written before blocks; anything else isn't ours to cut down
+            if (!is_legacy(m_map, m_map_size))
+            {
+                throw std::runtime_error(m_path + ": not a log file");
+            }
+            m_legacy = true;
+            m_blocks.push_back({ 0, 0, 0, uint8_t(block::codec::none) });
+            off = index_records(0, m_map, m_map_size);
+        }
+        else
+        {
+            std::vector<char> raw;
+            while (off < m_map_size)
+            {
+                block::view v;
+                auto st = block::parse(m_map + off, m_map_size - off, v);
+                if (st != block::status::ok)
+                {
+                    // a torn block from a crash mid write is the last thing in the file, everything before
+                    // it is fine; damage with intact blocks after it would lose those, so we refuse to open
+                    auto torn = st == block::status::bad_crc
+                            ? off + v.total >= m_map_size
+                            : !intact_block_in(m_map + off + 1, m_map_size - off - 1);
+                    if (!torn)
+                    {
+                        throw std::runtime_error(m_path + ": damaged block at offset " + std::to_string(off));
+                    }
+                    break;
+                }
+
+                const char* data = v.stored;
+                if (v.c != block::codec::none)
+                {
+                    block::decode(v, raw);
+                    data = raw.data();
+                }
+
+                auto id = uint32_t(m_blocks.size());
+                m_blocks.push_back({ off + block::header_size, v.stored_size, v.raw_size, uint8_t(v.c) });
+                if (index_records(id, data, v.raw_size) != v.raw_size)
+                {
+                    throw std::runtime_error(m_path + ": bad record in block at offset " + std::to_string(off));
+                }
+                off += v.total;
+            }
+        }
+
+        if (off < m_map_size)
+        {
+            // only a tail behind records that read fine is cut, with none there's nothing to tell it's torn
+            if (off == 0)
+            {
+                throw std::runtime_error(m_path + ": no intact block at the start");
+            }
+
+            // drop the garbage so new appends stay readable
+            if (::truncate(m_path.c_str(), off) == 0)
+            {
+                m_map_size = off;
+            }
+        }
+    }
+
+    size_t log_store::index_records(uint32_t block, const char* data, size_t size)
+    {
+        size_t off = 0;
+        while (off < size)
+        {
+            auto begin = off;
+            try
+            {
+                auto oh = msgpack::unpack(data, size, off, reference_all);
+                auto index = record_index(oh.get());
+                if (index == bad_record)
+                {
+                    return begin;
+                }
+                if (index < 0)
+                {
+                    continue;
+                }
+
+                if (size_t(index) >= m_index.size())
+                {
+                    m_index.resize(index + 1);
+                }
+                if (m_index[index].length == 0)
+                {
+                    ++m_live;
+                }
+                m_index[index] = { block, uint32_t(off - begin), begin };
+                ++m_records;
+            }
+            catch (std::exception&)
+            {
+                return begin;
+            }
+        }
+        return off;
+    }
+
+    std::shared_ptr<const std::vector<char>> log_store::payload(uint32_t block, const char*& data) const
+    {
+        auto& b = m_blocks[block];
+        if (b.codec == uint8_t(block::codec::none))
+        {
+            data = m_map + b.offset;
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lk{m_cache_prot};
+        for (auto& c : m_cache)
+        {
+            if (c.first == block)
+            {
+                data = c.second->data();
+                return c.second;
+            }
+        }
+
+        block::view v;
+        v.c = block::codec(b.codec);
+        v.stored = m_map + b.offset;
+        v.stored_size = b.stored_size;
+        v.raw_size = b.raw_size;
+
+        auto buf = std::make_shared<std::vector<char>>();
+        block::decode(v, *buf);
+
+        // recovery and catch up read in slot order, a handful of blocks is plenty
+        if (m_cache.size() >= cached_blocks)
+        {
+            m_cache.erase(m_cache.begin());
+        }
+        m_cache.emplace_back(block, buf);
+        data = buf->data();
+        return buf;
+    }
+
+    bool log_store::compact()
+    {
+        auto ok = write_sealed(m_path, [this](auto&& emit) {
+            for (int i = 0; i < int(m_index.size()); ++i)
+            {
+                if (m_index[i].length == 0) continue;
+                emit(i, read(i));
+            }
+        });
+        if (!ok)
+        {
+            return false;
+        }
+
+        unmap();
+        map();
+        build_index();
+        return true;
+    }
+
+    void log_store::save_snapshot(const std::vector<char>& bytes)
+    {
+        auto path = m_path + ".snap";
+        auto tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            throw std::system_error(errno, std::generic_category(), "can't open " + tmp);
+        }
+
+        try
+        {
+            std::string out;
+            block::encode(block::codec::zstd, bytes.data(), bytes.size(), out);
+            write_all(fd, out.data(), out.size());
+            if (::fdatasync(fd) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "snapshot sync");
+            }
+        }
+        catch (std::exception&)
+        {
+            ::close(fd);
+            std::remove(tmp.c_str());
+            throw;
+        }
+        ::close(fd);
+
+        if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        {
+            auto err = errno;
+            std::remove(tmp.c_str());
+            throw std::system_error(err, std::generic_category(), "can't replace " + path);
+        }
+    }
+
+    std::vector<char> log_store::load_snapshot() const
+    {
+        std::vector<char> res;
+        int fd = ::open((m_path + ".snap").c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return res;
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) == 0)
+        {
+            res.resize(st.st_size);
+            size_t off = 0;
+            while (off < res.size())
+            {
+                auto n = ::read(fd, res.data() + off, res.size() - off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                off += n;
+            }
+            res.resize(off);
+        }
+        ::close(fd);
+
+        // snapshots from before blocks are stored bare
+        if (!block::is_block(res.data(), res.size()))
+        {
+            return res;
+        }
+
+        block::view v;
+        if (block::parse(res.data(), res.size(), v) != block::status::ok)
+        {
+            throw std::runtime_error("damaged snapshot " + m_path + ".snap");
+        }
+        std::vector<char> raw;
+        block::decode(v, raw);
+        return raw;
+    }
+
+    log_entry log_store::read(int index) const
+    {
+        auto& s = m_index[index];
+        const char* data;
+        auto keep = payload(s.block, data);
+        auto oh = msgpack::unpack(data + s.offset, s.length, reference_all);
+        return decode_record(oh.get());
+    }
+
+    uint64_t log_store::append(int index, const log_entry& entry)
+    {
+        msgpack::sbuffer sbuf;
+        pack_record(sbuf, index, entry);
+
+        uint64_t seq;
+        {
+            std::lock_guard<std::mutex> lk{m_queue_prot};
+            m_pending.emplace_back(sbuf.data(), sbuf.size());
+            seq = ++m_queued;
+        }
+        m_queue_cv.notify_one();
+        return seq;
+    }
+
+    void log_store::wait(uint64_t seq)
+    {
+        if (m_mode == durability::none)
+        {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lk{m_queue_prot};
+        m_durable_cv.wait(lk, [this, seq] { return m_durable >= seq || m_error != 0; });
+        if (m_durable < seq)
+        {
+            throw std::system_error(m_error, std::generic_category(), "log persistence");
+        }
+    }
+
+    void log_store::publish(uint64_t seq)
+    {
+        {
+            std::lock_guard<std::mutex> lk{m_queue_prot};
+            m_durable = seq;
+        }
+        m_durable_cv.notify_all();
+    }
+
+    void log_store::flush_loop()
+    {
+        // a huge batch would only delay its first writer
+        constexpr size_t max_batch = 4096;
+
+        std::vector<std::string> batch;
+        std::string buf;
+        std::string out;
+        while (true)
+        {
+            uint64_t last;
+            durability mode;
+            {
+                std::unique_lock<std::mutex> lk{m_queue_prot};
+                m_queue_cv.wait(lk, [this] { return !m_pending.empty() || m_stopping; });
+                if (m_pending.empty())
+                {
+                    return;
+                }
+
+                mode = m_mode;
+                if (mode == durability::group && !m_stopping)
+                {
+                    // let the other writers of this window join the flush
+                    m_queue_cv.wait_for(lk, m_window.load(), [this] {
+                        return m_pending.size() >= max_batch || m_stopping;
+                    });
+                }
+
+                batch.swap(m_pending);
+                last = m_queued;
+            }
+
+            auto first = last - batch.size() + 1;
+            try
+            {
+                if (mode == durability::per_op)
+                {
+                    for (size_t i = 0; i < batch.size(); ++i)
+                    {
+                        out.clear();
+                        block::encode(block::codec::lz4, batch[i].data(), batch[i].size(), out);
+                        m_writer->write(m_fd, out.data(), out.size(), m_write_off, true);
+                        m_write_off += out.size();
+                        m_bytes_written += out.size();
+                        publish(first + i);
+                    }
+                }
+                else
+                {
+                    buf.clear();
+                    for (auto& rec : batch)
+                    {
+                        buf += rec;
+                    }
+
+                    // the whole batch in one block, records of neighbouring slots compress well together
+                    out.clear();
+                    block::encode(block::codec::lz4, buf.data(), buf.size(), out);
+                    m_writer->write(m_fd, out.data(), out.size(), m_write_off, mode == durability::group);
+                    m_write_off += out.size();
+                    m_bytes_written += out.size();
+                    publish(last);
+                }
+            }
+            catch (std::system_error& err)
+            {
+                {
+                    std::lock_guard<std::mutex> lk{m_queue_prot};
+                    m_error = err.code().value();
+                }
+                m_durable_cv.notify_all();
+                return;
+            }
+
+            batch.clear();
+        }
+    }
+}
@@ -2,11 +2,26 @@
 #include <spdlog/spdlog.h>
 #include <paxos/paxos.hpp>
 #include <paxos/local_end.hpp>
+#include <paxos/trace.hpp>
+#include <paxos/admission.hpp>
 #include <future>
+#include <thread>
 #include <nlohmann/json.hpp>
 #include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <csignal>
 #include <rpc/this_handler.h>
 
+namespace
+{
+    std::atomic<bool> stopping{false};
+
+    extern "C" void on_term(int)
+    {
+        stopping = true;
+    }
+}
 
 int main(int argc, char** argv) {
     std::ifstream in("config.json");
@@ -17,6 +32,7 @@ int main(int argc, char** argv) {
     {
         std::string host;
         int port;
+        bool learner;
     };
 
     std::vector<node> nodes;
@@ -25,6 +41,7 @@ int main(int argc, char** argv) {
         node n;
         n.host = p["ip"].get<std::string>();
         n.port = p["port"].get<int>();
+        n.learner = p.value("role", std::string("voter")) == "learner";
         nodes.push_back(n);
     }
 
@@ -32,82 +49,158 @@ int main(int argc, char** argv) {
     auto node_id = std::stoi(argv[1]);
     using namespace paxos;
 
+    paxos::trace::start("trace" + std::to_string(node_id) + ".bin", node_id);
+
     rpc::server serv(nodes[node_id].port*2);
-    local_end me(nodes[node_id].port, node_id);
+    local_end me(nodes[node_id].port, node_id, nodes[node_id].learner);
+
+    auto durability = config.value("durability", std::string("group"));
+    auto window = std::chrono::microseconds(config.value("group_commit_us", 200));
+    if (durability == "none")
+    {
+        me.set_durability(log_store::durability::none, window);
+    }
+    else if (durability == "per_op")
+    {
+        me.set_durability(log_store::durability::per_op, window);
+    }
+    else
+    {
+        me.set_durability(log_store::durability::group, window);
+    }
+
+    me.set_escrow(config.value("escrow_grant", 0));
 
-    serv.bind("buy", [&me, &log] (int num_ticks, int node_id) -> uint8_t {
-        auto log_index = me.get_first_hole();
-        if (log_index == -1)
+    // catch up transfers share the link with consensus, keep them from hogging it
+    me.set_bulk_rate(int64_t(config.value("bulk_mb_per_s", 64)) * 1024 * 1024);
+
+    // 1 sends every acceptor the whole command
+    me.set_erasure(config.value("erasure_k", 1), config.value("erasure_min_bytes", size_t(4096)));
+
+    // acceptors a leader change and a commit need, 0 for a majority; q1 + q2 has to exceed the voters
+    auto quorum = config.value("quorum", nlohmann::json::object());
+    paxos::quorums sizes(quorum.value("phase_one", 0), quorum.value("phase_two", 0), config.value("erasure_k", 1));
+    auto voters = int(std::count_if(nodes.begin(), nodes.end(), [](const node& n) { return !n.learner; }));
+    if (!sizes.fits(voters))
+    {
+        log->warn("Phase one quorum doesn't meet every phase two quorum of {} voters, using {} instead",
+                  voters, sizes.phase_one(voters));
+    }
+    me.set_quorums(quorum.value("phase_one", 0), quorum.value("phase_two", 0));
+
+    // peers on this machine are reached through shared memory, TCP stays for the rest and for transfers
+    me.set_shared_memory(config.value("shared_memory", true));
+
+    admission::limits limits;
+    auto adm = config.value("admission", nlohmann::json::object());
+    limits.max_inflight = adm.value("max_inflight", limits.max_inflight);
+    limits.max_queue = adm.value("max_queue", limits.max_queue);
+    limits.client_rate = adm.value("client_rate", limits.client_rate);
+    limits.client_burst = adm.value("client_burst", limits.client_burst);
+    limits.max_wait = std::chrono::milliseconds(adm.value("max_wait_ms", int(limits.max_wait.count())));
+    admission gate(limits);
+
+    // tells the client to come back later instead of queueing it without bound
+    auto reject = [](std::chrono::milliseconds retry_after) {
+        rpc::this_handler().respond_error(std::make_tuple(std::string("overloaded"), int(retry_after.count())));
+        return uint8_t(0xFF);
+    };
+
+    const auto self = uint8_t(node_id);
+    serv.bind("buy", [&me, &gate, &reject, self] (int num_ticks, int node_id, int session, int request) -> uint8_t {
+        std::chrono::milliseconds retry_after;
+        // the session tells apart clients that share a client id
+        auto ticket = gate.enter(session != 0 ? session : node_id, retry_after);
+        if (!ticket)
         {
-            log_index = me.get_last_log() + 1;
+            return reject(retry_after);
         }
-        log->info("Proposing log index: {}", log_index);
-        if (me.am_i_leader())
+        if (me.sell_local(num_ticks))
         {
-            log->info("Taking the fast route");
-            auto p1res = std::make_pair(paxos::ballot{ 1, node_id, log_index }, paxos::value{ 0, { node_id, num_ticks } });
-            log->info("{}: {}", node_id, me.phase_two(p1res));
+            return self;
         }
-        else if (!me.get_leader())
+        return me.propose(paxos::value{ 0, { node_id, num_ticks, session, request } });
+    });
+
+    serv.bind("cc", [&me, &log, &gate, &reject] (int client_id) {
+        std::chrono::milliseconds retry_after;
+        auto ticket = gate.enter(client_id, retry_after);
+        if (!ticket)
         {
-            log->info("Taking the slow route :(");
-            auto p1res = me.phase_one(paxos::value{0, {node_id, num_ticks}}, log_index);
-            if (p1res) {
-                log->info("{}: {}", node_id, me.phase_two(*p1res));
-            }
+            return reject(retry_after);
         }
 
-        auto id = me.get_leader_id();
-        rpc::this_handler().respond(id);
+        log->info("Adding 3, 4 to the config");
+
+        auto id = me.propose(paxos::value{ 1, { }, { 3, 4 } });
+
+        log->info("Leader: {}", int(me.get_leader_id()));
+        log->info("Heartbeat result: {}", me.send_heartbeats());
+
         return id;
     });
 
-    serv.bind("cc", [&me, &log, &node_id] () {
-        auto log_index = me.get_first_hole();
-        if (log_index == -1)
+    serv.bind("submit", [&me, &gate, &reject] (int client_id, paxos::blob payload) {
+        std::chrono::milliseconds retry_after;
+        auto ticket = gate.enter(client_id, retry_after);
+        if (!ticket)
         {
-            log_index = me.get_last_log() + 1;
+            return reject(retry_after);
         }
-        log->info("Adding 3, 4 to the config");
-        log->info("Proposing log index: {}", log_index);
+        return me.propose(paxos::value{ std::move(payload) });
+    });
 
-        if (me.am_i_leader())
+    serv.bind("promote", [&me, &gate, &reject] (int client_id, int learner) {
+        std::chrono::milliseconds retry_after;
+        auto ticket = gate.enter(client_id, retry_after);
+        if (!ticket)
         {
-            log->info("Taking the fast route");
-            auto p1res = std::make_pair(paxos::ballot{ 1, node_id, log_index }, paxos::value{ 1, { }, { 3, 4 } });
-            log->info("{}: {}", node_id, me.phase_two(p1res));
+            return reject(retry_after);
         }
-        else
+        return me.propose(paxos::value{ paxos::promote{ learner } });
+    });
+
+    // reads are served by any node, but not from a view older than the bound
+    const auto max_staleness = std::chrono::milliseconds(config.value("max_staleness_ms", 1000));
+    auto stale = [&me, max_staleness] {
+        auto behind = me.staleness();
+        if (behind <= max_staleness)
         {
-            log->info("Taking the slow route :(");
-            auto p1res = me.phase_one(paxos::value{0, {}, { 3, 4 }}, log_index);
-            if (p1res) {
-                log->info("{}: {}", node_id, me.phase_two(*p1res));
-            }
+            return false;
         }
+        rpc::this_handler().respond_error(std::make_tuple(std::string("stale"), int(behind.count())));
+        return true;
+    };
 
-        log->info("Leader: {}", int(me.get_leader_id()));
-        log->info("Heartbeat result: {}", me.send_heartbeats());
-
-        return me.get_leader_id();
+    serv.bind("summary", [&me, &stale] () {
+        if (stale()) return paxos::summary{};
+        return me.summary();
     });
 
-    serv.bind("show", [&me] () {
-        std::ostringstream oss;
-        me.show(oss);
-        return oss.str();
+    serv.bind("log_range", [&me, &stale] (int cursor, int limit) {
+        if (stale()) return paxos::log_page{};
+        return me.log_range(cursor, limit);
     });
 
     serv.bind("hb", [&me]{
         return true;
     });
 
+    // for upgrades, -1 picks the voter furthest along; doesn't queue behind clients
+    serv.bind("transfer", [&me] (int to) {
+        return me.transfer_leadership(to < 0 ? 0xFF : uint8_t(to));
+    });
+
+    serv.bind("stats", [&gate]{
+        return gate.get_stats();
+    });
+
     log->info("creating local end on {}, with id {}", nodes[node_id].port, node_id);
 
-    for (int i = 0; i < nodes.size(); ++i)
+    for (int i = 0; i < int(nodes.size()); ++i)
     {
         if (i == node_id) continue;
-        me.add_endpoint(i, nodes[i].host, nodes[i].port);
+        me.add_endpoint(i, nodes[i].host, nodes[i].port, nodes[i].learner);
     }
 
     me.detect_leader();
@@ -128,7 +221,27 @@ int main(int argc, char** argv) {
         }
     }*/
 
-    serv.run();
+    // every queued request holds a worker, keep a couple spare so rejections stay fast
+    serv.async_run(limits.max_inflight + limits.max_queue + 2);
+
+    // a restart for an upgrade sends SIGTERM, a leader hands over instead of leaving the cluster to time it out
+    std::signal(SIGTERM, on_term);
+
+    for (int tick = 1; !stopping; ++tick)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (tick % 50 != 0) continue;
+        auto st = gate.get_stats();
+        log->info("queue depth {} (max {}), admitted {}, rejected {} overload / {} rate / {} timed out, service {:.1f} ms",
+                  st.depth, st.max_depth, st.admitted, st.rejected_overload, st.rejected_rate, st.timed_out, st.service_ms);
+    }
+
+    if (me.am_i_leader())
+    {
+        log->info("Stopping, handing leadership over first");
+        me.transfer_leadership();
+    }
+    serv.stop();
 
     return 0;
 }
\ No newline at end of file
@@ -25,11 +25,21 @@ namespace paxos
     }
 
     bool ticket_sell::operator!=(const ticket_sell &rhs) const {
-        return std::tie(client_id, ticket_count) != std::tie(rhs.client_id, rhs.ticket_count);
+        return std::tie(client_id, ticket_count, session, request) !=
+               std::tie(rhs.client_id, rhs.ticket_count, rhs.session, rhs.request);
+    }
+
+    bool ticket_sell::operator==(const ticket_sell &rhs) const {
+        return !(*this != rhs);
     }
 
     std::ostream &operator<<(std::ostream &os, const ticket_sell &ts) {
-        return os << "ts(" << ts.client_id << ", " << ts.ticket_count << ")";
+        os << "ts(" << ts.client_id << ", " << ts.ticket_count;
+        if (ts.session != 0)
+        {
+            os << ", " << ts.session << "/" << ts.request;
+        }
+        return os << ")";
     }
 
     std::ostream &operator<<(std::ostream &os, const config_chg &cc) {
@@ -40,36 +50,118 @@ namespace paxos
         return std::tie(new_node1, new_node2) != std::tie(rhs.new_node1, rhs.new_node2);
     }
 
-    value::value() {
-        type = -1;
+    bool config_chg::operator==(const config_chg &rhs) const {
+        return !(*this != rhs);
+    }
+
+    bool quota::operator!=(const quota &rhs) const {
+        return std::tie(node_id, delta, sold) != std::tie(rhs.node_id, rhs.delta, rhs.sold);
+    }
+
+    bool quota::operator==(const quota &rhs) const {
+        return !(*this != rhs);
+    }
+
+    std::ostream &operator<<(std::ostream &os, const quota &q) {
+        return os << "qt(" << q.node_id << ", " << q.delta << ", " << q.sold << ")";
+    }
+
+    bool promote::operator!=(const promote &rhs) const {
+        return node_id != rhs.node_id;
+    }
+
+    bool promote::operator==(const promote &rhs) const {
+        return !(*this != rhs);
+    }
+
+    std::ostream &operator<<(std::ostream &os, const promote &p) {
+        return os << "pr(" << p.node_id << ")";
+    }
+
+    blob::blob(std::vector<char> data)
+            : bytes(std::make_shared<const std::vector<char>>(std::move(data))) {}
+
+    bool blob::operator!=(const blob &rhs) const {
+        if (bytes == rhs.bytes) return false;
+        if (size() != rhs.size()) return true;
+        return size() != 0 && std::memcmp(data(), rhs.data(), size()) != 0;
+    }
+
+    bool blob::operator==(const blob &rhs) const {
+        return !(*this != rhs);
+    }
+
+    std::ostream &operator<<(std::ostream &os, const blob &b) {
+        return os << "blob(" << b.size() << " bytes)";
+    }
+
+    bool fragment::operator!=(const fragment &rhs) const {
+        return std::tie(index, k, n, size) != std::tie(rhs.index, rhs.k, rhs.n, rhs.size) || bytes != rhs.bytes;
+    }
+
+    bool fragment::operator==(const fragment &rhs) const {
+        return !(*this != rhs);
+    }
+
+    std::ostream &operator<<(std::ostream &os, const fragment &f) {
+        return os << "fr(" << f.index << " of " << f.k << "/" << f.n << ", " << f.size << " bytes)";
+    }
+
+    bool coded::operator!=(const coded &rhs) const {
+        if (frag == rhs.frag) return false;
+        if (!frag || !rhs.frag) return true;
+        return *frag != *rhs.frag;
+    }
+
+    bool coded::operator==(const coded &rhs) const {
+        return !(*this != rhs);
+    }
+
+    std::ostream &operator<<(std::ostream &os, const coded &c) {
+        if (!c.frag) return os << "fr()";
+        return os << *c.frag;
     }
 
     value::value(int, ticket_sell tsell)
-            : type(0), ts(tsell) {}
+            : data(tsell) {}
 
     value::value(int, ticket_sell, config_chg cchg)
-            : type(1), cc(cchg) {}
+            : data(cchg) {}
 
-    bool value::operator!=(const value &rhs) const {
-        if (rhs.type != type)
-        {
-            return false;
-        }
+    value::value(quota q)
+            : data(q) {}
 
-        if (type == 0)
-        {
-            return ts != rhs.ts;
-        }
-        else
-        {
-            return cc != rhs.cc;
-        }
+    value::value(promote p)
+            : data(p) {}
+
+    value::value(blob b)
+            : data(std::move(b)) {}
+
+    value::value(fragment f)
+            : data(coded{ std::make_shared<const fragment>(std::move(f)) }) {}
+
+    bool value::operator!=(const value &rhs) const {
+        return data != rhs.data;
     }
 
     bool value::operator==(const value &rhs) const {
         return !(*this != rhs);
     }
 
+    std::ostream &operator<<(std::ostream &os, const value &v) {
+        std::visit([&os](const auto& alt) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(alt)>, std::monostate>)
+            {
+                os << "null";
+            }
+            else
+            {
+                os << alt;
+            }
+        }, v.data);
+        return os;
+    }
+
     bool promise::operator!=(const promise &rhs) const {
         return std::tie(bal, accept_num, accept_val) !=
                std::tie(rhs.bal, rhs.accept_num, rhs.accept_val);
@@ -0,0 +1,43 @@
+#include <paxos/quorum.hpp>
+#include <algorithm>
+
+namespace paxos
+{
+    quorums::quorums(int phase_one, int phase_two, int erasure_k) :
+            m_q1(std::max(phase_one, 0)), m_q2(std::max(phase_two, 0)), m_k(std::max(erasure_k, 1))
+    {
+    }
+
+    int quorums::majority(int voters)
+    {
+        return voters / 2 + 1;
+    }
+
+    int quorums::phase_two(int voters, bool coded) const
+    {
+        auto q2 = m_q2 > 0 ? std::min(m_q2, voters) : majority(voters);
+        if (coded && m_k > 1)
+        {
+            // even two coded quorums share k acceptors, as they always have
+            q2 = std::max(q2, (voters + m_k + 1) / 2);
+        }
+        return std::min(q2, voters);
+    }
+
+    int quorums::phase_one(int voters) const
+    {
+        auto q1 = m_q1 > 0 ? m_q1 : majority(voters);
+        q1 = std::max(q1, voters - phase_two(voters) + 1);
+        if (m_k > 1)
+        {
+            q1 = std::max(q1, voters + m_k - phase_two(voters, true));
+        }
+        return std::min(q1, voters);
+    }
+
+    bool quorums::fits(int voters) const
+    {
+        auto q1 = m_q1 > 0 ? m_q1 : majority(voters);
+        return q1 <= voters && phase_one(voters) == q1;
+    }
+}
@@ -3,108 +3,137 @@
 //
 
 #include <paxos/remote_end.hpp>
+#include <paxos/trace.hpp>
+#include <thread>
 
 namespace paxos
 {
-    std::future<bool> remote_end::heartbeat(int node_id) {
-        auto p = std::make_shared<std::promise<bool>>();
+    std::future<int> remote_end::heartbeat(int node_id, int period_ms) {
+        return control_call<int, 100>("heartbeat", node_id, period_ms);
+    }
+
+    std::future<paxos::promise> remote_end::prepare(paxos::ballot b) {
+        // the id of the round travels with the call, the thread we hand off to doesn't know it
+        return control_call<paxos::promise>("prepare", b, trace::current());
+    }
+
+    std::future<bool> remote_end::accept(paxos::ballot b, paxos::value v) {
+        return control_call<bool>("accept", b, v, trace::current());
+    }
+
+    std::future<uint8_t> remote_end::get_leader_id() {
+        return control_call<uint8_t>("get_leader");
+    }
+
+    std::future<bool> remote_end::pre_vote(int node_id, int last_log) {
+        return control_call<bool, 100>("pre_vote", node_id, last_log);
+    }
+
+    std::future<bool> remote_end::timeout_now(int node_id, int last_log) {
+        // the remote runs a whole election before it answers
+        return control_call<bool, 2000>("timeout_now", node_id, last_log);
+    }
+
+    std::future<uint8_t> remote_end::propose(paxos::value v) {
+        return control_call<uint8_t, 5000>("propose", v, trace::current());
+    }
+
+    std::future<std::map<int, log_entry>> remote_end::get_log_entry(int index, int limit) {
+        auto p = std::make_shared<std::promise<std::map<int, log_entry>>>();
         auto res = p->get_future();
 
-        std::async(std::launch::async, [this, p, node_id]() mutable {
+        std::thread([this, p, index, limit, tid = trace::current()]() mutable {
             try {
-                auto [c, fut] = async_call<100>("heartbeat", node_id);
-                auto r = fut.get().as<bool>();
+                auto [c, fut] = async_bulk_call("get_log", index, limit, tid);
+                auto r = fut.get().as<std::map<int, log_entry>>();
                 p->set_value(r);
             }
             catch (std::exception &e) {
                 p->set_exception(std::current_exception());
             }
-        });
+        }).detach();
 
         return res;
     }
 
-    std::future<paxos::promise> remote_end::prepare(paxos::ballot b) {
-        auto p = std::make_shared<std::promise<paxos::promise>>();
+    std::future<std::pair<int, int>> remote_end::get_log_bounds() {
+        auto p = std::make_shared<std::promise<std::pair<int, int>>>();
         auto res = p->get_future();
 
-        std::async(std::launch::async, [this, p, b]() mutable {
+        std::thread([this, p]() mutable {
             try {
-                auto [c, fut] = async_call("prepare", b);
-                auto r = fut.get().as<paxos::promise>();
+                auto [c, fut] = async_bulk_call("log_bounds");
+                auto r = fut.get().as<std::pair<int, int>>();
                 p->set_value(r);
             }
             catch (std::exception &e) {
                 p->set_exception(std::current_exception());
             }
-        });
+        }).detach();
 
         return res;
     }
 
-    std::future<bool> remote_end::accept(paxos::ballot b, paxos::value v) {
-        auto p = std::make_shared<std::promise<bool>>();
+    std::future<paxos::snapshot_chunk> remote_end::get_snapshot(int last_log, uint64_t offset) {
+        auto p = std::make_shared<std::promise<paxos::snapshot_chunk>>();
         auto res = p->get_future();
 
-        std::async(std::launch::async, [this, p, b, v]() mutable {
+        std::thread([this, p, last_log, offset]() mutable {
             try {
-                auto [c, fut] = async_call("accept", b, v);
-                auto r = fut.get().as<bool>();
+                auto [c, fut] = async_bulk_call("get_snapshot", last_log, offset);
+                auto r = fut.get().as<paxos::snapshot_chunk>();
                 p->set_value(r);
             }
             catch (std::exception &e) {
                 p->set_exception(std::current_exception());
             }
-        });
+        }).detach();
 
         return res;
     }
 
-    std::future<uint8_t> remote_end::get_leader_id() {
-        auto p = std::make_shared<std::promise<uint8_t>>();
+    std::future<log_entry> remote_end::get_slot(int index) {
+        auto p = std::make_shared<std::promise<log_entry>>();
         auto res = p->get_future();
 
-        std::async(std::launch::async, [this, p]() mutable {
+        std::thread([this, p, index]() mutable {
             try {
-                auto [c, fut] = async_call("get_leader");
-                auto r = fut.get().as<uint8_t>();
+                auto [c, fut] = async_bulk_call("get_slot", index);
+                auto r = fut.get().as<log_entry>();
                 p->set_value(r);
             }
             catch (std::exception &e) {
                 p->set_exception(std::current_exception());
             }
-        });
+        }).detach();
 
         return res;
     }
 
-    std::future<std::map<int, log_entry>> remote_end::get_log_entry(int index) {
-        auto p = std::make_shared<std::promise<std::map<int, log_entry>>>();
+    std::future<int> remote_end::replicate(int node_id, std::map<int, log_entry> entries) {
+        auto p = std::make_shared<std::promise<int>>();
         auto res = p->get_future();
 
-        std::async(std::launch::async, [this, p, index]() mutable {
+        std::thread([this, p, node_id, entries = std::move(entries), tid = trace::current()]() mutable {
             try {
-                auto [c, fut] = async_call("get_log", index);
-                auto r = fut.get().as<std::map<int, log_entry>>();
+                auto [c, fut] = async_bulk_call("replicate", node_id, entries, tid);
+                auto r = fut.get().as<int>();
                 p->set_value(r);
             }
             catch (std::exception &e) {
                 p->set_exception(std::current_exception());
             }
-        });
+        }).detach();
 
         return res;
     }
 
     void remote_end::inform(paxos::ballot b, paxos::value v) {
-        std::async(std::launch::async, [this, b, v]() mutable {
-            try {
-                auto [c, fut] = async_call("inform", b, v);
-                fut.wait();
-            }
-            catch (std::exception& e) {
-                //std::cerr << "the guy's dead\n";
-            }
-        });
+        // nobody waits for the answer, a dead peer learns the decision when it catches up
+        control_call<void>("inform", b, v, trace::current());
+    }
+
+    void remote_end::set_link(std::shared_ptr<shm::link> l) {
+        m_link = std::move(l);
     }
 }
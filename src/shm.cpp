@@ -0,0 +1,456 @@
+#include <paxos/shm.hpp>
+#include <cerrno>
+#include <csignal>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace paxos
+{
+namespace shm
+{
+    namespace msgpack = RPCLIB_MSGPACK;
+
+    namespace
+    {
+        enum kind
+        {
+            request = 0,
+            reply = 1,
+            reply_part = 2 // [kind, id, total size, offset, bytes] of a packed reply
+        };
+
+        // room left in a message for the header of a part
+        constexpr size_t part_size = ring::max_message - 64;
+
+        // how long the reader sleeps at most, calls that timed out are failed this often
+        constexpr auto sweep_period = std::chrono::milliseconds(10);
+
+        // a reply waits this long for room before it's dropped, its caller times out then
+        constexpr auto reply_patience = std::chrono::milliseconds(5);
+    }
+
+    bool is_local(const std::string& host)
+    {
+        if (host == "localhost" || host == "::1" || host.compare(0, 4, "127.") == 0)
+        {
+            return true;
+        }
+        char name[256] = {};
+        return gethostname(name, sizeof name - 1) == 0 && host == name;
+    }
+
+    struct link::segment
+    {
+        std::atomic<int32_t> pid[2];
+        ring::state rings[2];
+        char data[2][ring::capacity];
+    };
+
+    dispatcher::dispatcher(int workers)
+    {
+        for (int i = 0; i < workers; ++i)
+        {
+            m_workers.emplace_back([this] {
+                std::unique_lock<std::mutex> lk{m_prot};
+                while (true)
+                {
+                    m_cv.wait(lk, [this] { return m_stop || !m_jobs.empty(); });
+                    if (m_jobs.empty())
+                    {
+                        return;
+                    }
+                    auto job = std::move(m_jobs.front());
+                    m_jobs.pop_front();
+                    lk.unlock();
+                    job();
+                    lk.lock();
+                }
+            });
+        }
+    }
+
+    dispatcher::~dispatcher()
+    {
+        stop();
+    }
+
+    void dispatcher::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lk{m_prot};
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for (auto& w : m_workers)
+        {
+            if (w.joinable())
+            {
+                w.join();
+            }
+        }
+    }
+
+    void dispatcher::post(const std::string& method, std::shared_ptr<msgpack::object_handle> msg,
+                          const msgpack::object& args, reply_fn reply)
+    {
+        auto it = m_handlers.find(method);
+        // args points into msg, which the job keeps alive
+        auto job = [this, it, msg, a = &args, reply = std::move(reply)] {
+            msgpack::sbuffer out;
+            bool ok = true;
+            try
+            {
+                if (it == m_handlers.end())
+                {
+                    throw std::runtime_error("no such call");
+                }
+                it->second(*a, out);
+            }
+            catch (std::exception& err)
+            {
+                out.clear();
+                msgpack::pack(out, std::string(err.what()));
+                ok = false;
+            }
+            reply(ok, out);
+        };
+
+        {
+            std::lock_guard<std::mutex> lk{m_prot};
+            if (m_stop)
+            {
+                return;
+            }
+            m_jobs.emplace_back(std::move(job));
+        }
+        m_cv.notify_one();
+    }
+
+    std::string link::name(int port_a, int port_b)
+    {
+        return "/paxos-" + std::to_string(std::min(port_a, port_b)) + "-" + std::to_string(std::max(port_a, port_b));
+    }
+
+    link::link(int self_port, int peer_port, std::shared_ptr<dispatcher> d) :
+            m_name(name(self_port, peer_port)), m_side(self_port < peer_port ? 0 : 1), m_dispatch(std::move(d))
+    {
+        auto& path = m_name;
+        int fd = shm_open(path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd == -1)
+        {
+            throw std::system_error(errno, std::system_category(), "can't open " + path);
+        }
+
+        // both sides truncate to the same size, the zeroes are an empty segment
+        if (ftruncate(fd, sizeof(segment)) == -1)
+        {
+            auto err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::system_category(), "can't size " + path);
+        }
+
+        auto mem = mmap(nullptr, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED)
+        {
+            throw std::system_error(errno, std::system_category(), "can't map " + path);
+        }
+        m_seg = static_cast<segment*>(mem);
+
+        m_out = std::make_unique<ring>(&m_seg->rings[m_side], m_seg->data[m_side]);
+        m_in = std::make_unique<ring>(&m_seg->rings[1 - m_side], m_seg->data[1 - m_side]);
+
+        // whatever is queued was for the process before us, and until our pid is up nothing new comes
+        m_in->skip();
+
+        m_running = true;
+        m_reader = std::thread([this] { read_loop(); });
+        m_seg->pid[m_side] = int32_t(getpid());
+    }
+
+    link::~link()
+    {
+        close();
+        munmap(m_seg, sizeof(segment));
+    }
+
+    bool link::up() const
+    {
+        if (!m_running)
+        {
+            return false;
+        }
+        auto pid = m_seg->pid[1 - m_side].load();
+        return pid != 0 && (kill(pid, 0) == 0 || errno == EPERM);
+    }
+
+    void link::close()
+    {
+        if (!m_running.exchange(false))
+        {
+            return;
+        }
+        m_seg->pid[m_side] = 0;
+        if (m_reader.joinable())
+        {
+            m_reader.join();
+        }
+        expire(clock::time_point::max());
+
+        // the peer is gone too, a restarted one creates the segment afresh
+        auto pid = m_seg->pid[1 - m_side].load();
+        if (pid == 0 || (kill(pid, 0) == -1 && errno == ESRCH))
+        {
+            shm_unlink(m_name.c_str());
+        }
+    }
+
+    uint64_t link::expect(clock::time_point deadline, completion done)
+    {
+        std::lock_guard<std::mutex> lk{m_pending_prot};
+        auto id = m_next_id++;
+        m_pending.emplace(id, pending{ deadline, std::move(done), {} });
+        return id;
+    }
+
+    void link::forget(uint64_t id)
+    {
+        std::lock_guard<std::mutex> lk{m_pending_prot};
+        m_pending.erase(id);
+    }
+
+    bool link::send(const msgpack::sbuffer& buf, bool wait_for_room)
+    {
+        std::lock_guard<std::mutex> lk{m_send_prot};
+        if (m_out->push(buf.data(), buf.size()))
+        {
+            return true;
+        }
+        if (!wait_for_room || buf.size() > ring::max_message)
+        {
+            return false;
+        }
+
+        auto give_up = clock::now() + reply_patience;
+        while (clock::now() < give_up)
+        {
+            std::this_thread::yield();
+            if (m_out->push(buf.data(), buf.size()))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void link::read_loop()
+    {
+        std::vector<char> buf;
+        auto last_sweep = clock::now();
+        while (m_running)
+        {
+            if (!m_in->pop(buf))
+            {
+                m_in->wait(sweep_period);
+            }
+            else
+            {
+                try
+                {
+                    auto msg = std::make_shared<msgpack::object_handle>(msgpack::unpack(buf.data(), buf.size()));
+                    auto& obj = msg->get();
+                    if (obj.type != msgpack::type::ARRAY || obj.via.array.size < 4)
+                    {
+                        continue;
+                    }
+                    switch (obj.via.array.ptr[0].as<int>())
+                    {
+                    case request:
+                        serve(std::move(msg));
+                        break;
+                    case reply:
+                        complete(obj);
+                        break;
+                    case reply_part:
+                        assemble(obj);
+                        break;
+                    }
+                }
+                catch (std::exception&)
+                {
+                    // a message we can't read is dropped, its caller times out
+                }
+            }
+
+            auto now = clock::now();
+            if (now - last_sweep >= sweep_period)
+            {
+                expire(now);
+                last_sweep = now;
+            }
+        }
+    }
+
+    void link::serve(std::shared_ptr<msgpack::object_handle> msg)
+    {
+        auto& arr = msg->get().via.array;
+        if (arr.size != 5)
+        {
+            return;
+        }
+        auto id = arr.ptr[1].as<uint64_t>();
+        auto method = arr.ptr[2].as<std::string>();
+        auto deadline = clock::time_point(std::chrono::nanoseconds(arr.ptr[3].as<int64_t>()));
+        if (clock::now() > deadline)
+        {
+            return;
+        }
+
+        std::weak_ptr<link> self = shared_from_this();
+        auto& args = arr.ptr[4];
+        m_dispatch->post(method, std::move(msg), args, [self, id](bool ok, const msgpack::sbuffer& result) {
+            auto me = self.lock();
+            if (!me || !me->m_running)
+            {
+                return;
+            }
+
+            msgpack::sbuffer buf;
+            msgpack::packer<msgpack::sbuffer> pk(&buf);
+            pk.pack_array(4);
+            pk.pack(int(reply));
+            pk.pack(id);
+            pk.pack(ok);
+            buf.write(result.data(), result.size());
+
+            if (buf.size() <= ring::max_message)
+            {
+                me->send(buf, true);
+                return;
+            }
+
+            // the call already ran, so the reply goes back in pieces rather than the call again over TCP
+            for (size_t off = 0; off < buf.size(); off += part_size)
+            {
+                auto len = std::min(part_size, buf.size() - off);
+                msgpack::sbuffer part;
+                msgpack::packer<msgpack::sbuffer> ppk(&part);
+                ppk.pack_array(5);
+                ppk.pack(int(reply_part));
+                ppk.pack(id);
+                ppk.pack(uint64_t(buf.size()));
+                ppk.pack(uint64_t(off));
+                ppk.pack_bin(uint32_t(len));
+                ppk.pack_bin_body(buf.data() + off, uint32_t(len));
+                if (!me->send(part, true))
+                {
+                    // the rest is no use without this piece, the caller times out
+                    return;
+                }
+            }
+        });
+    }
+
+    void link::complete(const msgpack::object& msg)
+    {
+        auto& arr = msg.via.array;
+        auto id = arr.ptr[1].as<uint64_t>();
+
+        completion done;
+        {
+            std::lock_guard<std::mutex> lk{m_pending_prot};
+            auto it = m_pending.find(id);
+            if (it == m_pending.end())
+            {
+                // came back after it timed out
+                return;
+            }
+            done = std::move(it->second.done);
+            m_pending.erase(it);
+        }
+
+        if (arr.ptr[2].as<bool>())
+        {
+            done(&arr.ptr[3], nullptr);
+        }
+        else
+        {
+            auto err = arr.ptr[3].as<std::string>();
+            done(nullptr, &err);
+        }
+    }
+
+    void link::assemble(const msgpack::object& msg)
+    {
+        auto& arr = msg.via.array;
+        if (arr.size != 5 || arr.ptr[4].type != msgpack::type::BIN)
+        {
+            return;
+        }
+        auto id = arr.ptr[1].as<uint64_t>();
+        auto total = arr.ptr[2].as<uint64_t>();
+        auto off = arr.ptr[3].as<uint64_t>();
+        auto& bytes = arr.ptr[4].via.bin;
+
+        std::string whole;
+        {
+            std::lock_guard<std::mutex> lk{m_pending_prot};
+            auto it = m_pending.find(id);
+            if (it == m_pending.end())
+            {
+                return;
+            }
+            auto& parts = it->second.parts;
+            if (off != parts.size() || off + bytes.size > total)
+            {
+                // a piece went missing, what's there can't be put together anymore
+                parts.clear();
+                return;
+            }
+            parts.append(bytes.ptr, bytes.size);
+            if (parts.size() < total)
+            {
+                return;
+            }
+            whole.swap(parts);
+        }
+
+        // the pieces make up an ordinary reply
+        auto oh = msgpack::unpack(whole.data(), whole.size());
+        auto& obj = oh.get();
+        if (obj.type == msgpack::type::ARRAY && obj.via.array.size == 4)
+        {
+            complete(obj);
+        }
+    }
+
+    void link::expire(clock::time_point now)
+    {
+        std::vector<completion> late;
+        {
+            std::lock_guard<std::mutex> lk{m_pending_prot};
+            for (auto it = m_pending.begin(); it != m_pending.end();)
+            {
+                if (it->second.deadline <= now)
+                {
+                    late.push_back(std::move(it->second.done));
+                    it = m_pending.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        const std::string err = "timed out";
+        for (auto& done : late)
+        {
+            done(nullptr, &err);
+        }
+    }
+}
+}
@@ -0,0 +1,152 @@
+#include <paxos/shm_ring.hpp>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <thread>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace paxos
+{
+namespace shm
+{
+    namespace
+    {
+        constexpr uint32_t wrap_marker = UINT32_MAX;
+
+        // how long the consumer polls before it goes to sleep, a reply is usually closer than a futex wake up
+        constexpr auto spin_for = std::chrono::microseconds(50);
+
+        constexpr uint64_t record_size(size_t size)
+        {
+            return (sizeof(uint32_t) + size + 7) & ~uint64_t(7);
+        }
+
+        uint32_t* futex_word(std::atomic<uint32_t>& a)
+        {
+            return reinterpret_cast<uint32_t*>(&a);
+        }
+
+        // not the private flavours, the waiter is in another process
+        void futex_wait(std::atomic<uint32_t>& a, uint32_t expected, std::chrono::microseconds timeout)
+        {
+            timespec ts;
+            ts.tv_sec = timeout.count() / 1000000;
+            ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+            syscall(SYS_futex, futex_word(a), FUTEX_WAIT, expected, &ts, nullptr, 0);
+        }
+
+        void futex_wake(std::atomic<uint32_t>& a)
+        {
+            syscall(SYS_futex, futex_word(a), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+        }
+    }
+
+    bool ring::push(const char* data, size_t size)
+    {
+        if (size > max_message)
+        {
+            return false;
+        }
+
+        auto need = record_size(size);
+        auto head = m_st->head.load(std::memory_order_relaxed);
+        auto tail = m_st->tail.load(std::memory_order_acquire);
+
+        // positions are 8 byte aligned, so a marker always fits before the end
+        auto off = head % capacity;
+        auto to_end = capacity - off;
+        auto total = need <= to_end ? need : to_end + need;
+        if (head + total - tail > capacity)
+        {
+            return false;
+        }
+
+        if (need > to_end)
+        {
+            std::memcpy(m_data + off, &wrap_marker, sizeof wrap_marker);
+            head += to_end;
+            off = 0;
+        }
+
+        auto len = uint32_t(size);
+        std::memcpy(m_data + off, &len, sizeof len);
+        std::memcpy(m_data + off + sizeof len, data, size);
+
+        // the consumer either sees the new head, or we see it asleep and wake it
+        m_st->head.store(head + need, std::memory_order_seq_cst);
+        m_st->bell.fetch_add(1, std::memory_order_seq_cst);
+        if (m_st->sleeping.load(std::memory_order_seq_cst))
+        {
+            futex_wake(m_st->bell);
+        }
+        return true;
+    }
+
+    bool ring::pop(std::vector<char>& out)
+    {
+        auto tail = m_st->tail.load(std::memory_order_relaxed);
+        auto head = m_st->head.load(std::memory_order_acquire);
+        if (tail == head)
+        {
+            return false;
+        }
+
+        auto off = tail % capacity;
+        uint32_t len;
+        std::memcpy(&len, m_data + off, sizeof len);
+        if (len == wrap_marker)
+        {
+            tail += capacity - off;
+            off = 0;
+            std::memcpy(&len, m_data, sizeof len);
+        }
+
+        if (len > max_message || tail + record_size(len) > head)
+        {
+            // the other side wrote garbage, nothing in here can be trusted anymore
+            m_st->tail.store(head, std::memory_order_release);
+            return false;
+        }
+
+        out.assign(m_data + off + sizeof len, m_data + off + sizeof len + len);
+        m_st->tail.store(tail + record_size(len), std::memory_order_release);
+        return true;
+    }
+
+    bool ring::empty() const
+    {
+        return m_st->head.load(std::memory_order_seq_cst) == m_st->tail.load(std::memory_order_relaxed);
+    }
+
+    void ring::wait(std::chrono::microseconds timeout)
+    {
+        auto bell = m_st->bell.load(std::memory_order_seq_cst);
+
+        auto spin_until = std::chrono::steady_clock::now() + std::min(timeout, spin_for);
+        while (std::chrono::steady_clock::now() < spin_until)
+        {
+            if (!empty())
+            {
+                return;
+            }
+            std::this_thread::yield();
+        }
+
+        m_st->sleeping.store(1, std::memory_order_seq_cst);
+        if (empty())
+        {
+            // returns right away if the bell rang since we looked at it
+            futex_wait(m_st->bell, bell, timeout);
+        }
+        m_st->sleeping.store(0, std::memory_order_relaxed);
+    }
+
+    void ring::skip()
+    {
+        m_st->tail.store(m_st->head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+}
+}
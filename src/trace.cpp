@@ -0,0 +1,195 @@
+#include <paxos/trace.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace paxos
+{
+namespace trace
+{
+    namespace
+    {
+        constexpr size_t ring_size = 1 << 14;
+
+        // single producer (the owning thread), single consumer (the drain thread)
+        struct ring
+        {
+            event buf[ring_size];
+            std::atomic<uint64_t> head{0};
+            std::atomic<uint64_t> tail{0};
+            std::atomic<bool> in_use{true};
+            uint16_t thread = 0;
+        };
+
+        struct registry
+        {
+            std::mutex prot;
+            std::vector<std::unique_ptr<ring>> rings;
+            std::atomic<uint64_t> dropped{0};
+
+            FILE* out = nullptr;
+            std::thread drainer;
+            std::atomic<bool> running{false};
+
+            // main returning without stop() mustn't leave a joinable drainer behind
+            ~registry()
+            {
+                shutdown();
+            }
+
+            void shutdown()
+            {
+                if (!running) return;
+
+                running = false;
+                drainer.join();
+                std::fclose(out);
+                out = nullptr;
+            }
+
+            ring* acquire()
+            {
+                std::lock_guard<std::mutex> lk{prot};
+                for (auto& r : rings)
+                {
+                    // a ring of a dead thread is reused once it's been drained
+                    if (!r->in_use && r->head == r->tail)
+                    {
+                        r->in_use = true;
+                        return r.get();
+                    }
+                }
+                rings.push_back(std::make_unique<ring>());
+                rings.back()->thread = uint16_t(rings.size() - 1);
+                return rings.back().get();
+            }
+
+            void drain()
+            {
+                std::lock_guard<std::mutex> lk{prot};
+                for (auto& r : rings)
+                {
+                    auto tail = r->tail.load(std::memory_order_relaxed);
+                    auto head = r->head.load(std::memory_order_acquire);
+                    while (tail != head)
+                    {
+                        auto begin = tail % ring_size;
+                        auto count = std::min<uint64_t>(head - tail, ring_size - begin);
+                        if (out)
+                        {
+                            std::fwrite(&r->buf[begin], sizeof(event), count, out);
+                        }
+                        tail += count;
+                    }
+                    r->tail.store(tail, std::memory_order_release);
+                }
+                if (out)
+                {
+                    std::fflush(out);
+                }
+            }
+        };
+
+        registry& get_registry()
+        {
+            static registry reg;
+            return reg;
+        }
+
+        struct thread_ring
+        {
+            ring* r = get_registry().acquire();
+
+            ~thread_ring()
+            {
+                r->in_use = false;
+            }
+        };
+    }
+
+    void record(event_id id, const args& a)
+    {
+        thread_local thread_ring tr;
+        auto r = tr.r;
+
+        auto head = r->head.load(std::memory_order_relaxed);
+        if (head - r->tail.load(std::memory_order_acquire) >= ring_size)
+        {
+            get_registry().dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        auto& e = r->buf[head % ring_size];
+        e.ts_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        e.id = id;
+        e.thread = r->thread;
+        std::copy(std::begin(a.v), std::end(a.v), e.args);
+
+        r->head.store(head + 1, std::memory_order_release);
+    }
+
+    void start(const std::string& path, int node_id)
+    {
+        auto& reg = get_registry();
+        if (reg.running) return;
+
+        reg.out = std::fopen(path.c_str(), "wb");
+        if (!reg.out) return;
+
+        file_header hdr;
+        hdr.node_id = node_id;
+        std::fwrite(&hdr, sizeof hdr, 1, reg.out);
+
+        reg.running = true;
+        reg.drainer = std::thread([&reg] {
+            while (reg.running)
+            {
+                reg.drain();
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+            reg.drain();
+        });
+    }
+
+    void stop()
+    {
+        get_registry().shutdown();
+    }
+
+    uint64_t dropped()
+    {
+        return get_registry().dropped;
+    }
+
+    namespace
+    {
+        thread_local int32_t current_id = 0;
+    }
+
+    int32_t new_id(int node_id)
+    {
+        static std::atomic<uint32_t> counter{0};
+        return int32_t((uint32_t(node_id & 0x7F) << 24) | ((counter.fetch_add(1, std::memory_order_relaxed) + 1) & 0xFFFFFF));
+    }
+
+    int32_t current()
+    {
+        return current_id;
+    }
+
+    context::context(int32_t id) : m_prev(current_id)
+    {
+        current_id = id;
+    }
+
+    context::~context()
+    {
+        current_id = m_prev;
+    }
+}
+}
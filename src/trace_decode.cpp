@@ -0,0 +1,180 @@
+#include <paxos/trace.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Offline decoder for the binary traces written by paxos::trace.
+ * Usage: trace_decode [--chrome out.json] trace0.bin [trace1.bin ...]
+ * Events of all the given files are merged by timestamp and printed as
+ * text, or written as a Chrome trace that chrome://tracing and Perfetto
+ * open. There every node is a process, spans are slices and the spans of
+ * one proposal are chained by flow arrows across nodes.
+ */
+
+namespace
+{
+    struct node_event
+    {
+        int node_id;
+        paxos::trace::event ev;
+    };
+
+    bool read_file(const char* path, std::vector<node_event>& out)
+    {
+        std::ifstream in(path, std::ios::binary);
+        paxos::trace::file_header hdr;
+        if (!in.read(reinterpret_cast<char*>(&hdr), sizeof hdr) || std::memcmp(hdr.magic, "PXTR", 4) != 0)
+        {
+            std::cerr << path << ": not a trace file\n";
+            return false;
+        }
+        if (hdr.event_size != sizeof(paxos::trace::event))
+        {
+            std::cerr << path << ": unsupported event size " << hdr.event_size << '\n';
+            return false;
+        }
+
+        paxos::trace::event ev;
+        while (in.read(reinterpret_cast<char*>(&ev), sizeof ev))
+        {
+            out.push_back({ hdr.node_id, ev });
+        }
+        return true;
+    }
+
+    bool is_span(const paxos::trace::event& ev)
+    {
+        return ev.id == paxos::trace::span_begin || ev.id == paxos::trace::span_end;
+    }
+
+    const char* step_name(int32_t step)
+    {
+        return step >= 0 && step < paxos::trace::step_count ? paxos::trace::steps[step] : "unknown";
+    }
+
+    void write_chrome(std::FILE* out, const std::vector<node_event>& events)
+    {
+        const auto base = events.empty() ? 0 : events.front().ev.ts_ns;
+        std::fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+        bool first = true;
+        auto sep = [&] {
+            std::fprintf(out, first ? "  " : ",\n  ");
+            first = false;
+        };
+
+        std::set<int> nodes;
+        for (auto& e : events)
+        {
+            if (nodes.insert(e.node_id).second)
+            {
+                sep();
+                std::fprintf(out, R"({"name":"process_name","ph":"M","pid":%d,"args":{"name":"node %d"}})",
+                             e.node_id, e.node_id);
+            }
+        }
+
+        std::set<int32_t> flows;
+        for (auto& e : events)
+        {
+            auto& a = e.ev.args;
+            auto ts = (e.ev.ts_ns - base) / 1000.0;
+            if (e.ev.id >= paxos::trace::event_count) continue;
+
+            sep();
+            if (!is_span(e.ev))
+            {
+                std::fprintf(out, R"({"name":"%s","ph":"i","s":"t","ts":%.3f,"pid":%d,"tid":%u,"args":{"a":[%d,%d,%d,%d,%d,%d]}})",
+                             paxos::trace::events[e.ev.id].name, ts, e.node_id, unsigned(e.ev.thread),
+                             a[0], a[1], a[2], a[3], a[4], a[5]);
+                continue;
+            }
+
+            auto begin = e.ev.id == paxos::trace::span_begin;
+            std::fprintf(out, R"({"name":"%s","cat":"paxos","ph":"%s","ts":%.3f,"pid":%d,"tid":%u,"args":{"trace":"%x","slot":%d}})",
+                         step_name(a[1]), begin ? "B" : "E", ts, e.node_id, unsigned(e.ev.thread), unsigned(a[0]), a[2]);
+
+            // tie every span of a proposal to where it started, on whichever node
+            if (begin && a[0] != 0)
+            {
+                auto start = flows.insert(a[0]).second;
+                sep();
+                std::fprintf(out, R"({"name":"round","cat":"flow","ph":"%s","id":%d,"ts":%.3f,"pid":%d,"tid":%u%s})",
+                             start ? "s" : "t", a[0], ts, e.node_id, unsigned(e.ev.thread), start ? "" : R"(,"bp":"e")");
+            }
+        }
+
+        std::fprintf(out, "\n]}\n");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int first_file = 1;
+    const char* chrome = nullptr;
+    if (argc > 2 && std::string(argv[1]) == "--chrome")
+    {
+        chrome = argv[2];
+        first_file = 3;
+    }
+
+    if (argc <= first_file)
+    {
+        std::cerr << "usage: " << argv[0] << " [--chrome out.json] trace.bin...\n";
+        return 1;
+    }
+
+    std::vector<node_event> events;
+    for (int i = first_file; i < argc; ++i)
+    {
+        if (!read_file(argv[i], events))
+        {
+            return 1;
+        }
+    }
+
+    std::stable_sort(events.begin(), events.end(), [](const node_event& a, const node_event& b) {
+        return a.ev.ts_ns < b.ev.ts_ns;
+    });
+
+    if (chrome)
+    {
+        auto out = std::fopen(chrome, "w");
+        if (!out)
+        {
+            std::perror(chrome);
+            return 1;
+        }
+        write_chrome(out, events);
+        std::fclose(out);
+        return 0;
+    }
+
+    const auto base = events.empty() ? 0 : events.front().ev.ts_ns;
+    for (auto& e : events)
+    {
+        auto& a = e.ev.args;
+        std::printf("%12.3f us  node %d  thread %2u  ", (e.ev.ts_ns - base) / 1000.0, e.node_id, unsigned(e.ev.thread));
+        if (e.ev.id >= paxos::trace::event_count)
+        {
+            std::printf("unknown(%u)\n", unsigned(e.ev.id));
+            continue;
+        }
+
+        auto& info = paxos::trace::events[e.ev.id];
+        std::printf("%-14s ", info.name);
+        if (is_span(e.ev))
+        {
+            std::printf("%-12s trace=%x slot=%d\n", step_name(a[1]), unsigned(a[0]), a[2]);
+            continue;
+        }
+        std::printf(info.format, a[0], a[1], a[2], a[3], a[4], a[5]);
+        std::printf("\n");
+    }
+}